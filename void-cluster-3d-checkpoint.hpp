@@ -0,0 +1,313 @@
+// Checkpoints of a generation in progress, so that a long run can be resumed after it was interrupted.
+//
+// USAGE:  Checkpointer checkpointer(file_name);
+//         checkpointer.submit(mat3d, params, Stage::phase_2_and_3, count);   // between placements, returns right away
+//         ...
+//         Snapshot snapshot;
+//         read_snapshot(file_name, snapshot);
+//         check_compatible(snapshot, params);
+//         restore(mat3d, snapshot);                                           // then continue from snapshot.stage
+//
+// DEPENDENCY: STD only. Tested with C++17
+//
+
+#pragma once
+
+#include "void-cluster-3d.hpp"
+#include "void-cluster-3d-io.hpp"
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <cstring>
+
+namespace vc3d
+{
+
+// Stage a generation continues from. Phase 1 sub-stages are checkpointed once they are done.
+enum class Stage : uint32_t { initial_bitmap = 0, reorder_bitmap = 1, rank_initial_bitmap = 2, phase_2_and_3 = 3 };
+
+// Type of the energies in a snapshot, they are restored into a matrix of the same type only
+enum class EnergyType : uint32_t { float32 = 0, float64 = 1, fixed32 = 2 };
+
+template<class Energy>
+constexpr EnergyType energy_type_of()
+{
+    static_assert(std::is_same<Energy, float>::value || std::is_same<Energy, double>::value || std::is_same<Energy, int32_t>::value,
+        "energies are float, double or int32_t");
+    return std::is_same<Energy, float>::value ? EnergyType::float32 : std::is_same<Energy, double>::value ? EnergyType::float64 : EnergyType::fixed32;
+}
+
+inline size_t energy_size(EnergyType type)
+{
+    return type == EnergyType::float64 ? sizeof(double) : sizeof(float);
+}
+
+inline std::string energy_type_name(EnergyType type)
+{
+    return type == EnergyType::float32 ? "float" : type == EnergyType::float64 ? "double" : "fixed";
+}
+
+// Whole state of a generation. count is the next rank of phase_2_and_3.
+struct Snapshot
+{
+    Stage stage = Stage::initial_bitmap;
+    int64_t count = 0;
+    EnergyType energy_type = EnergyType::float32;
+
+    // Parameters the state depends on, checked on resume
+    int d0 = 0, d1 = 0, d2 = 0;
+    int filter_size = 0, filter_size_z = 0;
+    float sigma = 0, sigma_z = 0;
+    float kernel_tolerance = 0;
+    int initial_count = 0;
+
+    std::vector<uint32_t> ranks;
+    std::vector<uint8_t> energies;      // size() values of energy_type
+    std::vector<uint8_t> tracking;
+
+    int64_t size() const { return int64_t(d0) * d1 * d2; };
+};
+
+// File layout, little endian: "VC3DSNAP", version, stage, energy type, count (64 bit), d0, d1, d2, filter_size, filter_size_z,
+// sigma, sigma_z, kernel_tolerance, initial_count, then size() uint32 ranks, size() energies and size() bytes of tracking,
+// x fastest, then y, then z.
+constexpr char SNAPSHOT_MAGIC[8] = { 'V', 'C', '3', 'D', 'S', 'N', 'A', 'P' };
+constexpr uint32_t SNAPSHOT_VERSION = 5;
+
+// Buffers of the snapshot are reused, they allocate only the first time
+template<class TrackedMatrix>
+void capture(Snapshot& snapshot, const TrackedMatrix& mat3d, const Parameters& params, Stage stage, int64_t count)
+{
+    using Energy = typename TrackedMatrix::energy_type;
+    snapshot.stage = stage;
+    snapshot.count = count;
+    snapshot.energy_type = energy_type_of<Energy>();
+    snapshot.d0 = params.d0;
+    snapshot.d1 = params.d1;
+    snapshot.d2 = params.d2;
+    snapshot.filter_size = params.filter_size;
+    snapshot.filter_size_z = params.filter_size_along_z();
+    snapshot.sigma = params.sigma;
+    snapshot.sigma_z = params.sigma_along_z();
+    snapshot.kernel_tolerance = params.kernel_tolerance;
+    snapshot.initial_count = params.initial_count;
+
+    snapshot.ranks.resize(mat3d.size());
+    snapshot.energies.resize(mat3d.size() * sizeof(Energy));
+    snapshot.tracking.resize(mat3d.size());
+    mat3d.save_state(snapshot.ranks.data(), reinterpret_cast<Energy*>(snapshot.energies.data()), snapshot.tracking.data());
+}
+
+template<class TrackedMatrix>
+void restore(TrackedMatrix& mat3d, const Snapshot& snapshot)
+{
+    using Energy = typename TrackedMatrix::energy_type;
+    if (snapshot.energy_type != energy_type_of<Energy>())
+        throw std::invalid_argument("snapshot energies are " + energy_type_name(snapshot.energy_type));
+
+    // Cluster tracking is switched off by phase_2_and_3 only
+    mat3d.load_state(snapshot.ranks.data(), reinterpret_cast<const Energy*>(snapshot.energies.data()), snapshot.tracking.data(),
+        snapshot.stage != Stage::phase_2_and_3);
+}
+
+inline void check_compatible(const Snapshot& snapshot, const Parameters& params)
+{
+    if (snapshot.d0 != params.d0 || snapshot.d1 != params.d1 || snapshot.d2 != params.d2)
+        throw std::invalid_argument("snapshot size is " + std::to_string(snapshot.d0) + "x" + std::to_string(snapshot.d1) + "x" + std::to_string(snapshot.d2));
+    if (snapshot.filter_size != params.filter_size || snapshot.filter_size_z != params.filter_size_along_z() ||
+        snapshot.sigma != params.sigma || snapshot.sigma_z != params.sigma_along_z() || snapshot.kernel_tolerance != params.kernel_tolerance)
+        throw std::invalid_argument("snapshot filter is size " + std::to_string(snapshot.filter_size) + " (" + std::to_string(snapshot.filter_size_z) +
+            " along z), sigma " + std::to_string(snapshot.sigma) + " (" + std::to_string(snapshot.sigma_z) + " along z), tolerance " +
+            std::to_string(snapshot.kernel_tolerance));
+    if (snapshot.initial_count != params.initial_count)
+        throw std::invalid_argument("snapshot initial count is " + std::to_string(snapshot.initial_count));
+}
+
+template<class T>
+void read_pod(std::ifstream& file, T& value)
+{
+    file.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+template<class T>
+void write_array(std::ofstream& file, const std::vector<T>& values)
+{
+    file.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size()) * sizeof(T));
+}
+
+template<class T>
+void read_array(std::ifstream& file, std::vector<T>& values, int64_t size)
+{
+    values.resize(size);
+    file.read(reinterpret_cast<char*>(values.data()), static_cast<std::streamsize>(size) * sizeof(T));
+}
+
+// Written to a temporary file first and then renamed over file_name, so an interrupted write leaves the previous snapshot intact
+inline void write_snapshot(const std::string& file_name, const Snapshot& snapshot)
+{
+    const std::string temp_name = file_name + ".tmp";
+    {
+        std::ofstream file(temp_name, std::ios::binary);
+        if (!file)
+            throw std::runtime_error("cannot open " + temp_name);
+
+        file.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        write_pod(file, SNAPSHOT_VERSION);
+        write_pod(file, static_cast<uint32_t>(snapshot.stage));
+        write_pod(file, static_cast<uint32_t>(snapshot.energy_type));
+        write_pod(file, snapshot.count);
+        for (const int32_t value : { snapshot.d0, snapshot.d1, snapshot.d2, snapshot.filter_size, snapshot.filter_size_z })
+            write_pod(file, value);
+        write_pod(file, snapshot.sigma);
+        write_pod(file, snapshot.sigma_z);
+        write_pod(file, snapshot.kernel_tolerance);
+        write_pod(file, int32_t(snapshot.initial_count));
+        write_array(file, snapshot.ranks);
+        write_array(file, snapshot.energies);
+        write_array(file, snapshot.tracking);
+
+        if (!file.flush())
+            throw std::runtime_error("cannot write " + temp_name);
+    }
+    std::filesystem::rename(temp_name, file_name);
+}
+
+inline void read_snapshot(const std::string& file_name, Snapshot& snapshot)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("cannot open " + file_name);
+
+    char magic[sizeof(SNAPSHOT_MAGIC)] = {};
+    uint32_t version = 0, stage = 0, energy_type = 0;
+    file.read(magic, sizeof(magic));
+    read_pod(file, version);
+    if (!file || std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 || version != SNAPSHOT_VERSION)
+        throw std::runtime_error(file_name + " is not a snapshot of this version");
+
+    read_pod(file, stage);
+    read_pod(file, energy_type);
+    int64_t count = 0;
+    read_pod(file, count);
+    int32_t values[5] = {};
+    for (int32_t& value : values)
+        read_pod(file, value);
+    read_pod(file, snapshot.sigma);
+    read_pod(file, snapshot.sigma_z);
+    read_pod(file, snapshot.kernel_tolerance);
+    int32_t initial_count = 0;
+    read_pod(file, initial_count);
+    if (!file || stage > static_cast<uint32_t>(Stage::phase_2_and_3) || energy_type > static_cast<uint32_t>(EnergyType::fixed32) ||
+        values[0] <= 0 || values[1] <= 0 || values[2] <= 0)
+        throw std::runtime_error(file_name + ": invalid snapshot header");
+
+    snapshot.stage = static_cast<Stage>(stage);
+    snapshot.energy_type = static_cast<EnergyType>(energy_type);
+    snapshot.count = count;
+    snapshot.d0 = values[0];
+    snapshot.d1 = values[1];
+    snapshot.d2 = values[2];
+    snapshot.filter_size = values[3];
+    snapshot.filter_size_z = values[4];
+    snapshot.initial_count = initial_count;
+    if (snapshot.count < 0 || snapshot.count > snapshot.size())
+        throw std::runtime_error(file_name + ": invalid snapshot header");
+
+    read_array(file, snapshot.ranks, snapshot.size());
+    read_array(file, snapshot.energies, snapshot.size() * static_cast<int64_t>(energy_size(snapshot.energy_type)));
+    read_array(file, snapshot.tracking, snapshot.size());
+    if (!file)
+        throw std::runtime_error(file_name + ": snapshot is truncated");
+}
+
+// Writes snapshots on a background thread, so that checkpoints do not stall the generation.
+// Two buffers: submit() fills the one not being written and returns. If the previous snapshot is still
+// being written, the new one waits for it, and is replaced by the next submit() if that comes first.
+// submit() must be called from one thread.
+class Checkpointer
+{
+public:
+    explicit Checkpointer(std::string file_name) :
+        _file_name(std::move(file_name)),
+        _writer([this] { writer_loop(); })
+    {};
+    // Writes a snapshot still waiting before returning
+    ~Checkpointer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _writer.join();
+    };
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+
+    const std::string& file_name() const { return _file_name; };
+
+    template<class TrackedMatrix>
+    void submit(const TrackedMatrix& mat3d, const Parameters& params, Stage stage, int64_t count)
+    {
+        int buffer;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            buffer = _writing == 0 ? 1 : 0;
+            if (_pending == buffer)
+                _pending = NONE;
+        }
+        capture(_buffers[buffer], mat3d, params, stage, count);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending = buffer;
+        }
+        _wake.notify_all();
+    }
+
+    // Waits until all submitted snapshots are written. Returns the error of the last failed write, empty if none.
+    std::string flush()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [&] { return _pending == NONE && _writing == NONE; });
+        return _error;
+    }
+
+private:
+    static constexpr int NONE = -1;
+
+    void writer_loop()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [&] { return _stop || _pending != NONE; });
+            if (_pending == NONE)
+                return;
+
+            _writing = _pending;
+            _pending = NONE;
+            lock.unlock();
+            std::string error;
+            try
+            { write_snapshot(_file_name, _buffers[_writing]); }
+            catch (const std::exception& ex)
+            { error = ex.what(); }
+            lock.lock();
+            _writing = NONE;
+            if (!error.empty())
+                _error = error;
+            _idle.notify_all();
+        }
+    }
+
+    const std::string _file_name;
+    Snapshot _buffers[2];
+    std::mutex _mutex;
+    std::condition_variable _wake, _idle;
+    int _pending{ NONE }, _writing{ NONE };
+    bool _stop{ false };
+    std::string _error;
+    std::thread _writer;    // last, starts once everything else is constructed
+};
+
+} // namespace vc3d
@@ -0,0 +1,441 @@
+// Void and cluster tracking by a compute backend, e.g. a GPU: energies and the tracking of each voxel stay resident in
+// the backend, splats and the void and cluster reductions are its kernels, and only indices and single energies come
+// back. Ranks and occupancy are kept by the host. DeviceMatrix has the interface of Matrix3D_w_void_and_cluster_tracking
+// for the phase functions, so its textures can be compared with those of the CPU trackers.
+//
+// USAGE:  DeviceMatrix<HostBackend<float>> mat3d(params);
+//         phase_1(mat3d, params.initial_count, seed(params));
+//         phase_2_and_3(mat3d, params.initial_count);
+//
+// HostBackend runs the kernels on the host, one thread, as the reference of device backends (CUDA, Vulkan compute),
+// which are not in this tree. It gives the textures of the CPU trackers, bit for bit.
+//
+// DEPENDENCY: STD only. Tested with C++17
+//
+
+#pragma once
+
+#include "void-cluster-3d.hpp"
+
+namespace vc3d
+{
+
+// Filter tap of a backend: offset from the filter center along each axis, and value as an energy
+template<class Energy>
+struct DeviceTap
+{
+    int o0, o1, o2;
+    Energy value;
+};
+
+// Backend interface, indices are of voxels in raster order:
+//   energy_type                        float, double or int32_t fixed point, as Energy of the CPU matrix
+//   Backend(d0, d1, d2, taps)          allocates the volume, keeps the taps (DeviceTaps, in the filter's order)
+//   reset(seed, scale)                 energies to the jitter of seed (jitter_energy), every voxel tracked as a void
+//   splat(idx, sign)                   adds sign * filter centered at idx, on the torus, taps of one voxel in order
+//   track(idx, tracking)               tracking of voxel idx
+//   untrack_clusters()                 voxels tracked as clusters become untracked
+//   first_void(begin, end)             void of [begin, end) first in VoidOrder, -1 if none
+//   first_cluster(begin, end)          cluster of [begin, end) first in ClusterOrder, -1 if none
+//   energy(idx)                        energy of voxel idx
+//   download(energies, tracking)       all of them, size values each, e.g. for checkpoints
+//   upload(energies, tracking)
+
+// Reference backend. The splat is a kernel of a thread per tap, and the reductions are in two levels: each block of
+// BLOCK voxels is reduced to its top (a thread block), then the tops of the blocks of the range (a single block).
+// Blocks keep their tops until a splat or tracking change touches them, so a placement reduces about
+// filter.size() / BLOCK of them again. A device backend splatting filters larger than the volume along an axis adds
+// taps to the same voxel more than once, and has to add them in the filter's order to give the same energies.
+template<class Energy>
+class HostBackend
+{
+public:
+    using energy_type = Energy;
+    static constexpr int BLOCK = 1024;
+
+    HostBackend(int d0, int d1, int d2, std::vector<DeviceTap<Energy>> taps) :
+        _d0(d0), _d1(d1), _d2(d2),
+        _size(int64_t(d0) * d1 * d2),
+        _taps(std::move(taps)),
+        _energies(_size),
+        _tracking(_size, TRACKED_AS_VOID),
+        _void_tops((_size + BLOCK - 1) / BLOCK, STALE),
+        _cluster_tops((_size + BLOCK - 1) / BLOCK, STALE)
+    {};
+
+    void reset(unsigned int seed, double scale)
+    {
+        for (int64_t idx = 0; idx < _size; ++idx)
+            _energies[idx] = jitter_energy<Energy>(seed, idx, scale);
+        std::fill(_tracking.begin(), _tracking.end(), TRACKED_AS_VOID);
+        all_changed();
+    }
+
+    void splat(int64_t idx, Energy sign)
+    {
+        const int r0 = static_cast<int>(idx % _d0);
+        const int r1 = static_cast<int>(idx / _d0 % _d1);
+        const int r2 = static_cast<int>(idx / (int64_t(_d0) * _d1));
+        for (const DeviceTap<Energy>& tap : _taps)
+        {
+            int i0 = r0 + tap.o0;
+            int i1 = r1 + tap.o1;
+            int i2 = r2 + tap.o2;
+            mod(i0, _d0);
+            mod(i1, _d1);
+            mod(i2, _d2);
+            const int64_t voxel = i0 + (i1 + int64_t(i2) * _d1) * _d0;
+            _energies[voxel] += sign * tap.value;
+            changed(voxel);
+        }
+    }
+    void track(int64_t idx, Tracking tracking)
+    {
+        _tracking[idx] = tracking;
+        changed(idx);
+    }
+    void untrack_clusters()
+    {
+        std::replace(_tracking.begin(), _tracking.end(), uint8_t(TRACKED_AS_CLUSTER), uint8_t(UNTRACKED));
+        std::fill(_cluster_tops.begin(), _cluster_tops.end(), EMPTY);
+    }
+
+    int64_t first_void(int64_t begin, int64_t end) const    { return first<VoidOrder<Energy>>(TRACKED_AS_VOID, _void_tops, begin, end); };
+    int64_t first_cluster(int64_t begin, int64_t end) const { return first<ClusterOrder<Energy>>(TRACKED_AS_CLUSTER, _cluster_tops, begin, end); };
+    Energy  energy(int64_t idx) const                       { return _energies[idx]; };
+
+    void download(Energy* energies, uint8_t* tracking) const
+    {
+        std::copy(_energies.cbegin(), _energies.cend(), energies);
+        std::copy(_tracking.cbegin(), _tracking.cend(), tracking);
+    }
+    void upload(const Energy* energies, const uint8_t* tracking)
+    {
+        std::copy(energies, energies + _size, _energies.begin());
+        std::copy(tracking, tracking + _size, _tracking.begin());
+        all_changed();
+    }
+
+private:
+    static constexpr int64_t STALE = -2, EMPTY = -1;
+
+    // Second level, over the tops of the blocks of [begin, end). Blocks the range cuts are reduced for it alone.
+    template<class Order>
+    int64_t first(uint8_t tracking, std::vector<int64_t>& tops, int64_t begin, int64_t end) const
+    {
+        int64_t first = EMPTY;
+        auto take = [&](int64_t idx)
+        {
+            if (idx != EMPTY && (first == EMPTY || Order::before(_energies[idx], idx, _energies[first], first)))
+                first = idx;
+        };
+        for (int64_t block = begin / BLOCK; block * BLOCK < end; ++block)
+        {
+            const int64_t block_begin = block * BLOCK;
+            const int64_t block_end = std::min(block_begin + BLOCK, _size);
+            if (block_begin < begin || block_end > end)
+            {
+                take(reduce<Order>(tracking, std::max(begin, block_begin), std::min(end, block_end)));
+                continue;
+            }
+            if (tops[block] == STALE)
+                tops[block] = reduce<Order>(tracking, block_begin, block_end);
+            take(tops[block]);
+        }
+        return first;
+    }
+    // First level, the voxels of a block
+    template<class Order>
+    int64_t reduce(uint8_t tracking, int64_t begin, int64_t end) const
+    {
+        int64_t first = EMPTY;
+        for (int64_t idx = begin; idx < end; ++idx)
+            if (_tracking[idx] == tracking && (first == EMPTY || Order::before(_energies[idx], idx, _energies[first], first)))
+                first = idx;
+        return first;
+    }
+
+    void changed(int64_t idx)
+    {
+        _void_tops[idx / BLOCK] = STALE;
+        _cluster_tops[idx / BLOCK] = STALE;
+    }
+    void all_changed()
+    {
+        std::fill(_void_tops.begin(), _void_tops.end(), STALE);
+        std::fill(_cluster_tops.begin(), _cluster_tops.end(), STALE);
+    }
+
+    const int _d0, _d1, _d2;
+    const int64_t _size;
+    const std::vector<DeviceTap<Energy>> _taps;
+    std::vector<Energy> _energies;
+    std::vector<uint8_t> _tracking;     // Tracking of each voxel
+    mutable std::vector<int64_t> _void_tops, _cluster_tops;
+};
+
+// The matrix holds the ranks and occupancy, the backend the energies and tracking. Statistics count no tracker
+// operations, there are no trackers.
+template<class Backend>
+class DeviceMatrix : public RankMatrix3D
+{
+public:
+    using energy_type = typename Backend::energy_type;
+    using Energy = energy_type;
+
+    explicit DeviceMatrix(const Parameters& params) : DeviceMatrix(params, make_filter(params)) {};
+    // Filter can be shared between matrices, e.g. for batch generation
+    DeviceMatrix(const Parameters& params, std::shared_ptr<const GaussianKernel> shared_filter) :
+        RankMatrix3D(params.d0, params.d1, params.d2, params.ranks_file),
+        _occupied(params.size()),
+        _filter(std::move(shared_filter)),
+        filter(*_filter),
+        _energy_scale(energy_scale<Energy>(filter)),
+        _backend(params.d0, params.d1, params.d2, device_taps(filter, _energy_scale)),
+        _pool(params.threads)
+    {
+        if (!params.energies_file.empty())
+            throw std::invalid_argument("energies are kept by the backend, energies_file is not available");
+        if (params.fft_initialization)
+            throw std::invalid_argument("fft_initialization is not available with a backend");
+        for (const auto& tap : filter.taps())
+            _tap_energies.push_back(to_energy<Energy>(tap.value, _energy_scale));
+        _kept_candidates.resize(_pool.size());
+        _concurrent_voids.reserve(dim2());
+        _batch_candidates.reserve(dim2());
+        reset(seed(params));
+    };
+    DeviceMatrix(const DeviceMatrix&) = delete;
+    DeviceMatrix& operator=(const DeviceMatrix&) = delete;
+
+    // Back to the state before phase 1, with new random jitter
+    void reset(unsigned int seed)
+    {
+        fill(0);
+        _occupied.clear();
+        _cluster_tracking_is_on = true;
+        _backend.reset(seed, _energy_scale);
+        _progress->reset();
+    }
+
+    bool occupied(const T3& t3) const { return _occupied.test(T3_to_idx(t3)); };
+
+    // Unoccupied voxels are tracked as voids, so the voxel set was one
+    void set_pixel(const T3& t3, uint32_t rank)
+    {
+        const int64_t idx = T3_to_idx(t3);
+        if (_occupied.test(idx))
+            throw std::runtime_error("already set");
+        at(idx) = rank;
+        _occupied.set(idx);
+        ++_statistics.placements;
+        _backend.track(idx, _cluster_tracking_is_on ? TRACKED_AS_CLUSTER : UNTRACKED);
+        splat(idx, Energy(1));
+    }
+    // Same as set_pixel(t3, 0) for each of the points, on a matrix just reset(). The backend splats them, or with
+    // fft_convolution the energies are convolved on the host, between a download and an upload, as by
+    // Matrix3D_w_void_and_cluster_tracking.
+    void set_pixels(const std::vector<T3>& points, bool fft_convolution = false)
+    {
+        for (const T3& t3 : points)
+        {
+            const int64_t idx = T3_to_idx(t3);
+            if (_occupied.test(idx))
+                throw std::runtime_error("already set");
+            _occupied.set(idx);
+            _backend.track(idx, _cluster_tracking_is_on ? TRACKED_AS_CLUSTER : UNTRACKED);
+        }
+        _statistics.placements += points.size();
+        if (!fft_convolution)
+        {
+            for (const T3& t3 : points)
+                splat(T3_to_idx(t3), Energy(1));
+            return;
+        }
+
+        BasicMatrix3D<Energy> energies(dim0(), dim1(), dim2());
+        std::vector<uint8_t> tracking(size());
+        std::vector<int64_t> indices;
+        indices.reserve(points.size());
+        for (const T3& t3 : points)
+            indices.push_back(T3_to_idx(t3));
+        _backend.download(energies.data(), tracking.data());
+        add_periodic_convolution(energies, indices, filter, _tap_energies);
+        _backend.upload(energies.data(), tracking.data());
+    }
+    // Same points as Matrix3D_w_void_and_cluster_tracking::set_random_pixels()
+    void set_random_pixels(int count, unsigned int seed)
+    {
+        draw_random_candidates(size(), count, seed, _pool, _kept_candidates, _candidates);
+        _points.clear();
+        for (const RandomCandidate& candidate : _candidates)
+            _points.push_back(idx_to_T3(candidate.second));
+        set_pixels(_points);
+    }
+    void reset_pixel(const T3& t3)
+    {
+        const int64_t idx = T3_to_idx(t3);
+        at(idx) = 0;
+        _occupied.reset(idx);
+        _backend.track(idx, TRACKED_AS_VOID);
+        splat(idx, Energy(-1));
+    }
+
+    void remove_tracking(const T3& t3) { _backend.track(T3_to_idx(t3), UNTRACKED); };
+    void cluster_tracking_off()
+    {
+        if (!_cluster_tracking_is_on)
+            return;
+        _cluster_tracking_is_on = false;
+        _backend.untrack_clusters();
+    }
+
+    const T3   max_void()    const { return idx_to_T3(_backend.first_void(0, size())); };
+    Energy     energy(const T3& t3) const { return _backend.energy(T3_to_idx(t3)); };
+    const T3   max_cluster() const { return idx_to_T3(_backend.first_cluster(0, size())); };
+
+    // As Matrix3D_w_void_and_cluster_tracking's, with the same textures. Splats are in order, by the backend.
+    bool can_tile(int slabs) const
+    {
+        return slabs >= 2 && slabs % 2 == 0 && dim2() / slabs >= filter.dim2() - 1;
+    }
+    int set_largest_voids_of_slabs(int slabs, int64_t rank)
+    {
+        if (!can_tile(slabs))
+            throw std::invalid_argument("slabs must be even in number and as thick as the filter along z minus one");
+
+        const int64_t plane_size = int64_t(dim0()) * dim1();
+        int count = 0;
+        for (int parity = 0; parity < 2; ++parity)
+        {
+            _concurrent_voids.clear();
+            for (int slab = parity; slab < slabs; slab += 2)
+            {
+                const int64_t idx = _backend.first_void(slab * dim2() / slabs * plane_size, (slab + 1) * dim2() / slabs * plane_size);
+                if (idx >= 0)
+                    _concurrent_voids.push_back(idx);
+            }
+            set_concurrent_voids(rank + count);
+            count += static_cast<int>(_concurrent_voids.size());
+        }
+        return count;
+    }
+    int set_largest_voids_apart(int batch, int64_t rank)
+    {
+        const int64_t plane_size = int64_t(dim0()) * dim1();
+        _batch_candidates.clear();
+        for (int plane = 0; plane < dim2(); ++plane)
+        {
+            const int64_t idx = _backend.first_void(plane * plane_size, (plane + 1) * plane_size);
+            if (idx >= 0)
+                _batch_candidates.emplace_back(_backend.energy(idx), idx);
+        }
+        std::sort(_batch_candidates.begin(), _batch_candidates.end(), [](const auto& a, const auto& b)
+        {
+            return VoidOrder<Energy>::before(a.first, a.second, b.first, b.second);
+        });
+
+        _concurrent_voids.clear();
+        for (const auto& candidate : _batch_candidates)
+        {
+            if (static_cast<int>(_concurrent_voids.size()) == batch)
+                break;
+            const int plane = static_cast<int>(candidate.second / plane_size);
+            const bool apart = std::all_of(_concurrent_voids.cbegin(), _concurrent_voids.cend(), [&](int64_t idx)
+            {
+                const int distance = std::abs(static_cast<int>(idx / plane_size) - plane);
+                return std::min(distance, dim2() - distance) >= filter.dim2();
+            });
+            if (apart)
+                _concurrent_voids.push_back(candidate.second);
+        }
+        set_concurrent_voids(rank);
+        return static_cast<int>(_concurrent_voids.size());
+    }
+
+    const Statistics& statistics() const { return _statistics; };
+    Progress& progress() const { return *_progress; };
+    void report_progress_to(Progress& progress) { _progress = &progress; };
+    void reset_statistics() { _statistics = Statistics(); };
+
+    // Whole state of the generation, as Matrix3D_w_void_and_cluster_tracking's: checkpoints of either can be resumed by
+    // the other, with the same precision
+    bool cluster_tracking_is_on() const { return _cluster_tracking_is_on; };
+    void save_state(uint32_t* ranks, Energy* energies, uint8_t* tracking) const
+    {
+        std::copy(data(), data() + size(), ranks);
+        _backend.download(energies, tracking);
+    }
+    void load_state(const uint32_t* ranks, const Energy* energies, const uint8_t* tracking, bool cluster_tracking_on)
+    {
+        std::copy(ranks, ranks + size(), data());
+        for (int64_t idx = 0; idx < size(); ++idx)
+        {
+            if (tracking[idx] == TRACKED_AS_VOID)
+                _occupied.reset(idx);
+            else
+                _occupied.set(idx);
+        }
+        _cluster_tracking_is_on = cluster_tracking_on;
+        _backend.upload(energies, tracking);
+    }
+    void save_ranks(uint32_t* ranks, uint32_t unset_rank) const
+    {
+        for (int64_t idx = 0; idx < size(); ++idx)
+            ranks[idx] = _occupied.test(idx) ? get(idx) : unset_rank;
+    }
+
+private:
+    static std::vector<DeviceTap<Energy>> device_taps(const GaussianKernel& filter, double scale)
+    {
+        std::vector<DeviceTap<Energy>> taps;
+        taps.reserve(filter.size());
+        for (const auto& tap : filter.taps())
+            taps.push_back({ tap.g0 - filter.dim0() / 2, tap.g1 - filter.dim1() / 2, tap.g2 - filter.dim2() / 2,
+                             to_energy<Energy>(tap.value, scale) });
+        return taps;
+    }
+
+    void splat(int64_t idx, Energy sign)
+    {
+        ++_statistics.splats;
+        _statistics.taps += filter.size();
+        _backend.splat(idx, sign);
+    }
+    // Voids of _concurrent_voids to the ranks rank, rank + 1, ..
+    void set_concurrent_voids(int64_t rank)
+    {
+        int64_t next = rank;
+        for (const int64_t idx : _concurrent_voids)
+        {
+            at(idx) = static_cast<uint32_t>(next++);
+            _occupied.set(idx);
+            _backend.track(idx, _cluster_tracking_is_on ? TRACKED_AS_CLUSTER : UNTRACKED);
+        }
+        _statistics.placements += _concurrent_voids.size();
+        for (const int64_t idx : _concurrent_voids)
+            splat(idx, Energy(1));
+    }
+
+    Bitset _occupied;
+    const std::shared_ptr<const GaussianKernel> _filter;
+    const GaussianKernel& filter;
+    const double _energy_scale;
+    std::vector<Energy> _tap_energies;      // for FFT convolutions, in the filter's order
+    Backend _backend;
+    bool _cluster_tracking_is_on{ true };
+
+    ThreadPool _pool;
+    Statistics _statistics;
+    Progress _own_progress;
+    Progress* _progress{ &_own_progress };
+
+    // Scratch of set_random_pixels(), set_largest_voids_of_slabs() and set_largest_voids_apart()
+    std::vector<std::vector<RandomCandidate>> _kept_candidates;
+    std::vector<RandomCandidate> _candidates;
+    std::vector<T3> _points;
+    std::vector<int64_t> _concurrent_voids;
+    std::vector<std::pair<Energy, int64_t>> _batch_candidates;
+};
+
+} // namespace vc3d
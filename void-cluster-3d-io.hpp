@@ -0,0 +1,306 @@
+// Saving of generated 3D dithering patterns as single volume files: raw, DDS or KTX2 3D textures, and loading of 32 bit ones
+// and of exact ranks.
+// export_volumes() writes several bit depths and threshold masks of the same ranks in a single pass.
+// 
+// DEPENDENCY: STD only. Tested with C++17  
+//
+
+#pragma once
+
+#include "void-cluster-3d.hpp"
+#include <fstream>
+#include <cstring>
+#include <string>
+#include <sstream>
+
+namespace vc3d
+{
+
+// Volume files are written in a single pass over the ranks, x fastest, then y, then z, in little endian.
+// 32 bits are the rank values (rank / size, in [0, 1), see rank_value), 8, 10 and 16 bits are unsigned normalized,
+// 10 bits in 16 bit words (raw only). Masks are 8 bits, 255 for the voxels of the lowest ranks and 0 for the others.
+// Exact ranks are the ranks themselves, 32 bit unsigned, always raw: rank values of volumes of more than 2^24 voxels
+// are not exact in floats, neighbouring ranks share them.
+
+template<class T>
+void write_pod(std::ofstream& file, const T& value)
+{
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Rank to one of 2^bits levels, floor(rank * 2^bits / size), exactly: no level saturates or is skipped
+inline uint32_t quantize_rank(uint32_t rank, int64_t size, int bits)
+{
+    return static_cast<uint32_t>((uint64_t(rank) << bits) / uint64_t(size));
+}
+
+// One volume of an export: the ranks quantized to bits (8, 10, 16, or 32 for the rank values), or, if mask, the voxels
+// ranked below threshold * size as 255 and the others as 0, or, if exact, the ranks, raw whatever the format.
+struct VolumeExport
+{
+    std::string file_name;
+    int bits = 8;
+    bool mask = false;
+    float threshold = 0;
+    bool exact = false;
+};
+
+inline int bytes_per_voxel(const VolumeExport& target)
+{
+    return target.exact ? 4 : target.mask ? 1 : target.bits == 32 ? 4 : target.bits > 8 ? 2 : 1;
+}
+
+// Voxels [begin, end) of target, to out
+inline void convert_voxels(const RankMatrix3D& ranks, const VolumeExport& target, int64_t begin, int64_t end, char* out)
+{
+    const uint32_t* in = ranks.data();
+    if (target.exact)
+        std::memcpy(out, in + begin, (end - begin) * sizeof(uint32_t));
+    else if (target.mask)
+    {
+        const int64_t count = std::llround(double(target.threshold) * ranks.size());
+        for (int64_t idx = begin; idx < end; ++idx)
+            *out++ = static_cast<char>(in[idx] < count ? 0xFF : 0);
+    }
+    else if (target.bits == 32)
+    {
+        for (int64_t idx = begin; idx < end; ++idx, out += sizeof(float))
+        {
+            const float value = rank_value(in[idx], ranks.size());
+            std::memcpy(out, &value, sizeof(value));
+        }
+    }
+    else if (target.bits > 8)
+    {
+        for (int64_t idx = begin; idx < end; ++idx, out += sizeof(uint16_t))
+        {
+            const uint16_t value = static_cast<uint16_t>(quantize_rank(in[idx], ranks.size(), target.bits));
+            std::memcpy(out, &value, sizeof(value));
+        }
+    }
+    else
+        for (int64_t idx = begin; idx < end; ++idx)
+            *out++ = static_cast<char>(quantize_rank(in[idx], ranks.size(), target.bits));
+}
+
+// DDS with DX10 extension header, 3D texture, single mip level
+inline void write_dds_header(std::ofstream& file, const RankMatrix3D& mat3d, int bits)
+{
+    constexpr uint32_t DDSD_CAPS = 0x1, DDSD_HEIGHT = 0x2, DDSD_WIDTH = 0x4, DDSD_PITCH = 0x8, DDSD_PIXELFORMAT = 0x1000, DDSD_DEPTH = 0x800000;
+    constexpr uint32_t DDPF_FOURCC = 0x4;
+    constexpr uint32_t DDSCAPS_COMPLEX = 0x8, DDSCAPS_TEXTURE = 0x1000, DDSCAPS2_VOLUME = 0x200000;
+    constexpr uint32_t DXGI_FORMAT_R32_FLOAT = 41, DXGI_FORMAT_R16_UNORM = 56, DXGI_FORMAT_R8_UNORM = 61;
+    constexpr uint32_t D3D10_RESOURCE_DIMENSION_TEXTURE3D = 4;
+
+    const uint32_t pitch = mat3d.dim0() * bits / 8;
+    const uint32_t header[31] = {
+        124,                                                                            // dwSize
+        DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT | DDSD_DEPTH,
+        uint32_t(mat3d.dim1()), uint32_t(mat3d.dim0()), pitch, uint32_t(mat3d.dim2()),  // height, width, pitch, depth
+        1,                                                                              // dwMipMapCount
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,                                                // dwReserved1
+        32, DDPF_FOURCC, 0x30315844 /* "DX10" */, 0, 0, 0, 0, 0,                       // DDS_PIXELFORMAT
+        DDSCAPS_COMPLEX | DDSCAPS_TEXTURE, DDSCAPS2_VOLUME, 0, 0, 0 };                  // dwCaps, dwCaps2..4, dwReserved2
+    const uint32_t header_dx10[5] = {
+        bits == 8 ? DXGI_FORMAT_R8_UNORM : bits == 16 ? DXGI_FORMAT_R16_UNORM : DXGI_FORMAT_R32_FLOAT,
+        D3D10_RESOURCE_DIMENSION_TEXTURE3D, 0, 1, 0 };                                  // dimension, misc flag, array size, misc flags 2
+
+    file.write("DDS ", 4);
+    for (const uint32_t word : header)
+        write_pod(file, word);
+    for (const uint32_t word : header_dx10)
+        write_pod(file, word);
+}
+
+// KTX2, 3D texture, single level, basic data format descriptor with one (red) channel
+inline void write_ktx2_header(std::ofstream& file, const RankMatrix3D& mat3d, int bits)
+{
+    constexpr uint32_t VK_FORMAT_R8_UNORM = 9, VK_FORMAT_R16_UNORM = 70, VK_FORMAT_R32_SFLOAT = 100;
+    constexpr uint32_t HEADER_SIZE = 12 + 9 * 4 + 4 * 4 + 2 * 8;
+    constexpr uint32_t LEVEL_INDEX_SIZE = 3 * 8;
+    constexpr uint32_t DFD_SIZE = 4 + 24 + 16;
+    constexpr uint32_t DFD_OFFSET = HEADER_SIZE + LEVEL_INDEX_SIZE;
+    constexpr uint64_t DATA_OFFSET = DFD_OFFSET + DFD_SIZE;     // multiple of 4, as required for all three formats
+
+    const uint32_t type_size = bits / 8;
+    const uint64_t data_size = uint64_t(mat3d.size()) * type_size;
+    const bool is_float = bits == 32;
+
+    const unsigned char identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    file.write(reinterpret_cast<const char*>(identifier), sizeof(identifier));
+    const uint32_t header[9] = {
+        bits == 8 ? VK_FORMAT_R8_UNORM : bits == 16 ? VK_FORMAT_R16_UNORM : VK_FORMAT_R32_SFLOAT,
+        type_size,
+        uint32_t(mat3d.dim0()), uint32_t(mat3d.dim1()), uint32_t(mat3d.dim2()),
+        0, 1, 1,                                                    // layerCount, faceCount, levelCount
+        0 };                                                        // supercompressionScheme
+    for (const uint32_t word : header)
+        write_pod(file, word);
+    for (const uint32_t word : { DFD_OFFSET, DFD_SIZE, 0u, 0u })  // dfd offset & length, no key/value data
+        write_pod(file, word);
+    for (const uint64_t word : { uint64_t(0), uint64_t(0),          // no supercompression global data
+                                 DATA_OFFSET, data_size, data_size })  // level 0: offset, length, uncompressed length
+        write_pod(file, word);
+
+    const float sample_lower = -1.0f, sample_upper = 1.0f;
+    uint32_t lower, upper;
+    std::memcpy(&lower, &sample_lower, sizeof(lower));
+    std::memcpy(&upper, &sample_upper, sizeof(upper));
+    const uint32_t dfd[11] = {
+        DFD_SIZE,
+        0,                                                          // vendorId, descriptorType: basic
+        2 | (24 + 16) << 16,                                        // versionNumber, descriptorBlockSize
+        1 | 1 << 8 | 1 << 16,                                       // colorModel RGBSDA, primaries BT709, linear transfer
+        0,                                                          // texelBlockDimension 1x1x1x1
+        type_size,                                                  // bytesPlane0
+        0,
+        uint32_t(bits - 1) << 16 | uint32_t(is_float ? 0xC0 : 0x00) << 24,   // red channel, float & signed qualifiers for 32 bits
+        0,                                                          // samplePosition
+        is_float ? lower : 0,
+        is_float ? upper : (bits == 8 ? 0xFFu : 0xFFFFu) };
+    for (const uint32_t word : dfd)
+        write_pod(file, word);
+}
+
+// All the targets in a single pass over the ranks: a chunk of voxels at a time is converted for every target, split
+// between threads, and appended to each file. 10 bits are raw only, DDS and KTX2 have no such single channel format.
+// Exact ranks are raw in any format.
+inline void export_volumes(const RankMatrix3D& ranks, const std::vector<VolumeExport>& targets, const std::string& format, int threads = 1)
+{
+    std::vector<std::ofstream> files;
+    for (const VolumeExport& target : targets)
+    {
+        const int bits = target.mask ? 8 : target.bits;
+        if (bits == 10 && format != "raw")
+            throw std::invalid_argument("10 bits are raw only");
+        files.emplace_back(target.file_name, std::ios::binary);
+        if (!files.back())
+            throw std::runtime_error("cannot open " + target.file_name);
+        if (target.exact)
+            continue;
+        if (format == "dds")
+            write_dds_header(files.back(), ranks, bits);
+        else if (format == "ktx2")
+            write_ktx2_header(files.back(), ranks, bits);
+    }
+
+    constexpr int64_t CHUNK = 1 << 18;
+    std::vector<std::vector<char>> chunks;
+    for (const VolumeExport& target : targets)
+        chunks.emplace_back(std::min(CHUNK, ranks.size()) * bytes_per_voxel(target));
+    ThreadPool pool(threads);
+    for (int64_t begin = 0; begin < ranks.size(); begin += CHUNK)
+    {
+        const int64_t count = std::min(CHUNK, ranks.size() - begin);
+        pool.run([&](int worker)
+        {
+            const int64_t first = begin + count * worker / pool.size(), last = begin + count * (worker + 1) / pool.size();
+            for (size_t t = 0; t < targets.size(); ++t)
+                convert_voxels(ranks, targets[t], first, last, chunks[t].data() + (first - begin) * bytes_per_voxel(targets[t]));
+        });
+        for (size_t t = 0; t < targets.size(); ++t)
+            files[t].write(chunks[t].data(), count * bytes_per_voxel(targets[t]));
+    }
+
+    for (size_t t = 0; t < targets.size(); ++t)
+        if (!files[t].flush())
+            throw std::runtime_error("cannot write " + targets[t].file_name);
+}
+
+inline void save_volume(const RankMatrix3D& mat3d, const std::string& file_name, const std::string& format, int bits)
+{
+    VolumeExport target;
+    target.file_name = file_name;
+    target.bits = bits;
+    export_volumes(mat3d, { target }, format);
+}
+
+// The last size() voxels of type T of a file, x fastest, each to rank(value, idx) of ranks, which throws for invalid ones.
+// Sizes have to match, as raw files have no header.
+template<class T, class Rank>
+void load_voxels(RankMatrix3D& ranks, const std::string& file_name, Rank rank)
+{
+    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    if (!file)
+        throw std::runtime_error("cannot open " + file_name);
+    const std::streamoff data_size = std::streamoff(ranks.size()) * sizeof(T);
+    if (file.tellg() < data_size)
+        throw std::runtime_error(file_name + " is smaller than a 32 bit volume of this size");
+
+    constexpr int64_t CHUNK = 1 << 16;
+    std::vector<T> chunk(std::min(CHUNK, ranks.size()));
+    file.seekg(-data_size, std::ios::end);
+    for (int64_t begin = 0; begin < ranks.size(); begin += CHUNK)
+    {
+        const int64_t count = std::min(CHUNK, ranks.size() - begin);
+        if (!file.read(reinterpret_cast<char*>(chunk.data()), count * sizeof(T)))
+            throw std::runtime_error("cannot read " + file_name);
+        for (int64_t i = 0; i < count; ++i)
+            ranks.at(begin + i) = rank(chunk[i], begin + i);
+    }
+}
+
+// Ranks of a volume file saved with 32 bits, raw, DDS or KTX2: the voxels are the last size() floats of the file.
+// Exact up to 2^24 voxels only: beyond, neighbouring ranks share rank values, and load as the same rank (load_ranks()).
+inline void load_volume(RankMatrix3D& ranks, const std::string& file_name)
+{
+    load_voxels<float>(ranks, file_name, [&](float value, int64_t idx)
+    {
+        const double rank = std::round(double(value) * ranks.size());
+        if (!(rank >= 0 && rank <= ranks.size()) || rank_value(uint32_t(rank), ranks.size()) != value)
+            throw std::runtime_error(file_name + ": voxel " + std::to_string(idx) + " is not a rank value");
+        return uint32_t(rank);
+    });
+}
+
+// Ranks of a file of exact ranks (VolumeExport::exact), of any size
+inline void load_ranks(RankMatrix3D& ranks, const std::string& file_name)
+{
+    load_voxels<uint32_t>(ranks, file_name, [&](uint32_t rank, int64_t idx)
+    {
+        if (rank > ranks.size())
+            throw std::runtime_error(file_name + ": voxel " + std::to_string(idx) + " is not a rank");
+        return rank;
+    });
+}
+
+// Ranks to rank values in place, as saved in 32 bit raw volumes: with ranks mapped from a file (Parameters::ranks_file),
+// the file then is the volume, and is not written again. The matrix holds the bits of the floats afterwards.
+inline void ranks_to_rank_values(RankMatrix3D& ranks)
+{
+    for (int64_t idx = 0; idx < ranks.size(); ++idx)
+    {
+        const float value = rank_value(ranks.get(idx), ranks.size());
+        std::memcpy(&ranks.at(idx), &value, sizeof(value));
+    }
+}
+
+// e.g. volume.dds, or volume_64x64x64_u8.bin for raw. Headers tell the bits of DDS and KTX2, so their names tell them
+// only with_bits, e.g. volume_u16.dds beside volume.dds.
+inline std::string volume_file_name(const RankMatrix3D& mat3d, const std::string& format, int bits, bool with_bits = false)
+{
+    const std::string bits_suffix = bits == 32 ? "_f32" : "_u" + std::to_string(bits);
+    if (format != "raw")
+        return "volume" + (with_bits ? bits_suffix : "") + "." + format;
+    return "volume_" + std::to_string(mat3d.dim0()) + "x" + std::to_string(mat3d.dim1()) + "x" + std::to_string(mat3d.dim2()) +
+        bits_suffix + ".bin";
+}
+
+// e.g. ranks_64x64x64_u32.bin, in any format
+inline std::string ranks_file_name(const RankMatrix3D& mat3d)
+{
+    return "ranks_" + std::to_string(mat3d.dim0()) + "x" + std::to_string(mat3d.dim1()) + "x" + std::to_string(mat3d.dim2()) + "_u32.bin";
+}
+
+// e.g. mask_0.25.dds, or mask_0.25_64x64x64_u8.bin for raw
+inline std::string mask_file_name(const RankMatrix3D& mat3d, const std::string& format, float threshold)
+{
+    std::ostringstream name;
+    name << "mask_" << threshold;
+    if (format != "raw")
+        return name.str() + "." + format;
+    name << "_" << mat3d.dim0() << "x" << mat3d.dim1() << "x" << mat3d.dim2() << "_u8.bin";
+    return name.str();
+}
+
+} // namespace vc3d
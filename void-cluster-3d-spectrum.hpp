@@ -0,0 +1,195 @@
+// Spectral analysis of generated 3D dithering patterns, to check that faster modes do not degrade the noise.
+//
+// USAGE:  const auto profiles  = analyze_spectrum(mat3d, { 0.1f, 0.25f, 0.5f }, threads);
+//         const auto reference = analyze_spectrum(reference_mat3d, { 0.1f, 0.25f, 0.5f }, threads);
+//         const SpectrumComparison difference = compare_spectra(profiles[0], reference[0]);
+//
+// For each threshold g, the binary pattern of the voxels ranked below g * size is transformed by a 3D DFT, and its
+// power spectrum averaged over shells of radial frequency, as in R. Ulichney, "Dithering with Blue Noise" (1988).
+//
+// DEPENDENCY: STD only. Tested with C++17
+//
+
+#pragma once
+
+#include "void-cluster-3d.hpp"
+#include <vector>
+#include <cmath>
+
+namespace vc3d
+{
+
+// Radially averaged power spectrum of the pattern of one threshold. Bin b holds the frequencies f (in cycles per
+// voxel, per axis in [-1/2, 1/2)) with |f| * max dimension nearest to b. Power is normalized so that white noise
+// of the same density is 1, blue noise is well below 1 at low frequencies.
+struct SpectrumProfile
+{
+    float threshold = 0;                // fraction of the voxels in the pattern
+    std::vector<double> power;          // mean power per bin, 0 where the bin is empty
+    std::vector<double> anisotropy;     // variance of the power in the bin over its mean squared, 0 for empty bins
+    std::vector<int64_t> count;         // frequencies per bin, DC excluded
+    double low_frequency_power = 0;     // mean power below half the principal frequency cbrt(min(g, 1 - g)), near 0 for blue noise
+};
+
+struct SpectrumComparison
+{
+    double power_rms_difference = 0;        // over the bins both profiles have frequencies in
+    double power_max_difference = 0;
+    double anisotropy_mean_difference = 0;
+    double low_frequency_power_ratio = 0;   // this one's over the reference's
+};
+
+// Two thresholds go through each complex transform, one as real part and one as imaginary. Transforms and
+// accumulation of the bins are split between threads.
+inline std::vector<SpectrumProfile> analyze_spectrum(const RankMatrix3D& ranks, const std::vector<float>& thresholds, int threads = 1)
+{
+    const int dims[3] = { ranks.dim0(), ranks.dim1(), ranks.dim2() };
+    const int max_dim = std::max({ dims[0], dims[1], dims[2] });
+    const int bins = static_cast<int>(std::ceil(std::sqrt(3.0) / 2 * max_dim)) + 1;
+    const double size = ranks.size();
+
+    ThreadPool pool(threads);
+    std::vector<FFT::Complex> x(ranks.size());
+    std::vector<SpectrumProfile> profiles(thresholds.size());
+    for (size_t first = 0; first < thresholds.size(); first += 2)
+    {
+        const size_t pair = std::min<size_t>(2, thresholds.size() - first);
+        uint32_t counts[2] = {};
+        double densities[2] = {}, low_frequency[2] = {};
+        for (size_t p = 0; p < pair; ++p)
+        {
+            counts[p] = static_cast<uint32_t>(std::lround(double(thresholds[first + p]) * size));
+            densities[p] = counts[p] / size;
+            low_frequency[p] = std::cbrt(std::min(densities[p], 1 - densities[p])) / 2;
+        }
+
+        // Patterns minus their density, so that DC is 0
+        pool.run([&](int worker)
+        {
+            const int64_t end = ranks.size() * (worker + 1) / pool.size();
+            for (int64_t idx = ranks.size() * worker / pool.size(); idx < end; ++idx)
+            {
+                const uint32_t rank = ranks.get(idx);
+                x[idx] = FFT::Complex((rank < counts[0]) - densities[0], pair > 1 ? (rank < counts[1]) - densities[1] : 0.0);
+            }
+        });
+        for (int axis = 0; axis < 3; ++axis)
+            pool.run([&](int worker) { transform_lines(x, dims, axis, false, worker, pool.size()); });
+
+        // Sums of power and of its square per bin, and of power at low frequencies, per worker
+        struct Sums
+        {
+            std::vector<double> power, power2;
+            std::vector<int64_t> count;
+            double low = 0;
+            int64_t low_count = 0;
+        };
+        std::vector<Sums> sums[2];
+        for (size_t p = 0; p < pair; ++p)
+            sums[p].assign(pool.size(), Sums{ std::vector<double>(bins), std::vector<double>(bins), std::vector<int64_t>(bins) });
+
+        pool.run([&](int worker)
+        {
+            for (int k2 = worker; k2 < dims[2]; k2 += pool.size())
+            for (int k1 = 0; k1 < dims[1]; ++k1)
+            for (int k0 = 0; k0 < dims[0]; ++k0)
+            {
+                const int k[3] = { k0, k1, k2 };
+                if (k0 == 0 && k1 == 0 && k2 == 0)
+                    continue;
+
+                double f2 = 0;
+                int64_t neg = 0;
+                for (int axis = 2; axis >= 0; --axis)
+                {
+                    const double f = double(k[axis] < (dims[axis] + 1) / 2 ? k[axis] : k[axis] - dims[axis]) / dims[axis];
+                    f2 += f * f;
+                    neg = neg * dims[axis] + (dims[axis] - k[axis]) % dims[axis];
+                }
+                const double radius = std::sqrt(f2);
+                const int bin = static_cast<int>(std::lround(radius * max_dim));
+
+                // Spectra of the real patterns from the hermitian and antihermitian parts
+                const int64_t idx = k0 + (k1 + int64_t(k2) * dims[1]) * dims[0];
+                const FFT::Complex a = x[idx], b = std::conj(x[neg]);
+                const FFT::Complex spectra[2] = { (a + b) / 2.0, (a - b) / FFT::Complex(0, 2) };
+                for (size_t p = 0; p < pair; ++p)
+                {
+                    const double power = std::norm(spectra[p]) / (size * densities[p] * (1 - densities[p]));
+                    Sums& s = sums[p][worker];
+                    s.power[bin] += power;
+                    s.power2[bin] += power * power;
+                    ++s.count[bin];
+                    if (radius < low_frequency[p])
+                    {
+                        s.low += power;
+                        ++s.low_count;
+                    }
+                }
+            }
+        });
+
+        for (size_t p = 0; p < pair; ++p)
+        {
+            SpectrumProfile& profile = profiles[first + p];
+            profile.threshold = thresholds[first + p];
+            profile.power.assign(bins, 0);
+            profile.anisotropy.assign(bins, 0);
+            profile.count.assign(bins, 0);
+            std::vector<double> power2(bins);
+            double low = 0;
+            int64_t low_count = 0;
+            for (const Sums& s : sums[p])
+            {
+                for (int bin = 0; bin < bins; ++bin)
+                {
+                    profile.power[bin] += s.power[bin];
+                    power2[bin] += s.power2[bin];
+                    profile.count[bin] += s.count[bin];
+                }
+                low += s.low;
+                low_count += s.low_count;
+            }
+            for (int bin = 0; bin < bins; ++bin)
+            {
+                if (profile.count[bin] == 0)
+                    continue;
+                const double mean = profile.power[bin] / profile.count[bin];
+                profile.power[bin] = mean;
+                if (mean > 0)
+                    profile.anisotropy[bin] = std::max(0.0, power2[bin] / profile.count[bin] - mean * mean) / (mean * mean);
+            }
+            profile.low_frequency_power = low_count > 0 ? low / low_count : 0;
+        }
+    }
+    return profiles;
+}
+
+// Profiles of the same threshold, of volumes of the same size
+inline SpectrumComparison compare_spectra(const SpectrumProfile& profile, const SpectrumProfile& reference)
+{
+    if (profile.power.size() != reference.power.size())
+        throw std::invalid_argument("spectra of volumes of different sizes");
+
+    SpectrumComparison comparison;
+    int bins = 0;
+    for (size_t bin = 0; bin < profile.power.size(); ++bin)
+    {
+        if (profile.count[bin] == 0 || reference.count[bin] == 0)
+            continue;
+        const double difference = std::abs(profile.power[bin] - reference.power[bin]);
+        comparison.power_rms_difference += difference * difference;
+        comparison.power_max_difference = std::max(comparison.power_max_difference, difference);
+        comparison.anisotropy_mean_difference += profile.anisotropy[bin] - reference.anisotropy[bin];
+        ++bins;
+    }
+    if (bins > 0)
+    {
+        comparison.power_rms_difference = std::sqrt(comparison.power_rms_difference / bins);
+        comparison.anisotropy_mean_difference /= bins;
+    }
+    comparison.low_frequency_power_ratio = reference.low_frequency_power > 0 ? profile.low_frequency_power / reference.low_frequency_power : 0;
+    return comparison;
+}
+
+} // namespace vc3d
@@ -0,0 +1,159 @@
+// Provisional ranks of a generation in progress, for consumers such as previews that want threshold masks before
+// the texture is done.
+//
+// USAGE:  RankStream stream(params.d0, params.d1, params.d2);
+//         RankStream::Subscription subscription(stream);                   // consumer, e.g. on a thread of its own
+//         stream.publish(mat3d, count);                                    // generating thread, between placements
+//         if (const auto frame = subscription.next())                      // consumer
+//             export_volumes(frame->ranks, { { "preview.dds", 8, true, float(frame->count) / frame->ranks.size() } }, "dds");
+//
+// Ranks below count are final, the mask of the voxels ranked below count is the occupancy of the generation then.
+//
+// DEPENDENCY: STD only. Tested with C++17
+//
+
+#pragma once
+
+#include "void-cluster-3d.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+
+namespace vc3d
+{
+
+// Ranks of the voxels set, the others have UNSET_RANK. Streams are of fewer than 2^32 voxels, so that it is no rank.
+struct StreamFrame
+{
+    static constexpr uint32_t UNSET_RANK = std::numeric_limits<uint32_t>::max();
+
+    uint64_t sequence = 0;      // 1 for the first frame published, then 2, ..
+    int64_t count = 0;          // voxels set, ranks 0 .. count - 1
+    RankMatrix3D ranks;
+
+    StreamFrame(int d0, int d1, int d2) : ranks(d0, d1, d2) {};
+};
+
+// Ring of frames allocated up front. publish() copies the ranks into a frame nobody reads and makes it the latest,
+// it never waits for the consumers: if every other frame is still being read, the frame is dropped. Without a
+// subscription publish() returns right away and copies nothing. publish() must be called from one thread, frames
+// returned to subscribers must not outlive the stream.
+class RankStream
+{
+public:
+    // Consumer of the stream. publish() copies while at least one exists.
+    class Subscription
+    {
+    public:
+        explicit Subscription(RankStream& stream) : _stream(&stream) { ++stream._subscribers; };
+        ~Subscription() { if (_stream) --_stream->_subscribers; };
+        Subscription(Subscription&& other) noexcept : _stream(other._stream), _seen(other._seen) { other._stream = nullptr; };
+        Subscription(const Subscription&) = delete;
+        Subscription& operator=(const Subscription&) = delete;
+        Subscription& operator=(Subscription&&) = delete;
+
+        // Latest frame if newer than the one returned before, nullptr otherwise. The frame is not reused while held.
+        std::shared_ptr<const StreamFrame> next()
+        {
+            std::lock_guard<std::mutex> lock(_stream->_mutex);
+            return _stream->acquire_latest(_seen);
+        }
+        // Same as next(), waiting up to timeout for a newer frame
+        std::shared_ptr<const StreamFrame> wait_next(std::chrono::milliseconds timeout)
+        {
+            std::unique_lock<std::mutex> lock(_stream->_mutex);
+            _stream->_published.wait_for(lock, timeout, [&] { return _stream->_sequence > _seen; });
+            return _stream->acquire_latest(_seen);
+        }
+
+    private:
+        RankStream* _stream;
+        uint64_t _seen{ 0 };
+    };
+
+    // frames >= 2: the latest, and the others for publish() while some are read
+    RankStream(int d0, int d1, int d2, int frames = 3)
+    {
+        if (frames < 2)
+            throw std::invalid_argument("a stream needs at least 2 frames");
+        if (int64_t(d0) * d1 * d2 > int64_t(StreamFrame::UNSET_RANK))
+            throw std::invalid_argument("a stream has fewer than 2^32 voxels");
+        for (int i = 0; i < frames; ++i)
+            _frames.emplace_back(d0, d1, d2);
+        _readers.assign(frames, 0);
+    };
+    RankStream(const RankStream&) = delete;
+    RankStream& operator=(const RankStream&) = delete;
+
+    bool subscribed() const { return _subscribers.load() > 0; };
+
+    // Returns true if a frame was published, false if nobody is subscribed or every frame but the latest is read
+    template<class TrackedMatrix>
+    bool publish(const TrackedMatrix& mat3d, int64_t count)
+    {
+        if (!subscribed())
+            return false;
+
+        int frame = NONE;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (int i = 0; i < static_cast<int>(_frames.size()) && frame == NONE; ++i)
+                if (i != _latest && _readers[i] == 0)
+                    frame = i;
+            if (frame == NONE)
+            {
+                ++_dropped;
+                return false;
+            }
+        }
+
+        // Subscribers take the latest frame only, so this one is left alone while it is filled
+        StreamFrame& f = _frames[frame];
+        mat3d.save_ranks(f.ranks.data(), StreamFrame::UNSET_RANK);
+        f.count = count;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            f.sequence = ++_sequence;
+            _latest = frame;
+        }
+        _published.notify_all();
+        return true;
+    }
+
+    // Frames not published because every frame but the latest was being read
+    uint64_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _dropped;
+    }
+
+private:
+    static constexpr int NONE = -1;
+
+    // Under _mutex. The shared_ptr releases the frame when the last copy of it is gone.
+    std::shared_ptr<const StreamFrame> acquire_latest(uint64_t& seen)
+    {
+        if (_latest == NONE || _frames[_latest].sequence <= seen)
+            return nullptr;
+        const int frame = _latest;
+        seen = _frames[frame].sequence;
+        ++_readers[frame];
+        return std::shared_ptr<const StreamFrame>(&_frames[frame], [this, frame](const StreamFrame*)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_readers[frame];
+        });
+    }
+
+    std::vector<StreamFrame> _frames;
+    std::vector<int> _readers;          // shared_ptrs alive per frame
+    int _latest{ NONE };
+    uint64_t _sequence{ 0 };
+    uint64_t _dropped{ 0 };
+    std::atomic<int> _subscribers{ 0 };
+    mutable std::mutex _mutex;
+    std::condition_variable _published;
+};
+
+} // namespace vc3d
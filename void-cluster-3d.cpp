@@ -1,488 +1,1348 @@
 // Generating 3D dithering pattern (blue noise) following the paper of R. Ulichney (1993)
 //
-// The 2D algorithm presented in the paper is verbatim generalized to 3D.
+// Command line front end of the generator in void-cluster-3d.hpp
 // 
-// R. Ulichney, “The Void-and-Cluster Method for Generating Dither Arrays”,
-// Human Vision, Visual Processing, and Digital Display IV, J. Allebach and B. Rogowitz, eds., Proc. SPIE 1913, pp. 332-343, 1993.
-// Author's version of the paper can be found at: http://cv.ulichney.com/papers/1993-void-cluster.pdf
+// INPUT:  Modifiable parameters are at the top of this file and void-cluster-3d.hpp, and can be overridden from the command line (--help)
 // 
-// INPUT:  Modifiable parameters are at the top of the cpp file
-// 
-// OUTPUT: 3D pixel matrix is saved as layers of images.
-// 
-// DEPENDENCY: OpenCV and STD. Tested with C++17  
-// 
-// Caveat. Phase 3 is mathematically no different than Phase 2, thus, those 2 are merged together
-// (Finding largest cluster center of zeros, is equivalent to finding largest void center of ones)
+// OUTPUT: 3D pixel matrix is saved as layers of images, or as a single volume file.
 // 
+// DEPENDENCY: STD, and optionally OpenCV for saving layers as images and showing them. Tested with C++17  
+//             OpenCV is used if its headers are found, unless VC3D_NO_OPENCV is defined.
+//             Define VC3D_WITH_DEVICE for --tracker device, the backend tracking of void-cluster-3d-device.hpp.
 //
 
+#if !defined(VC3D_NO_OPENCV) && __has_include("opencv2/opencv.hpp")
+#define VC3D_WITH_OPENCV
 #include "opencv2/opencv.hpp"
+#endif
+#include "void-cluster-3d.hpp"
+#include "void-cluster-3d-io.hpp"
+#include "void-cluster-3d-checkpoint.hpp"
+#include "void-cluster-3d-spectrum.hpp"
+#include "void-cluster-3d-stream.hpp"
+#ifdef VC3D_WITH_DEVICE
+#include "void-cluster-3d-device.hpp"
+#endif
 #include <vector>
-#include <numeric>
 #include <string>
 #include <iostream>
-#include <random>
-#include <cmath>
-#include <tuple>
+#include <fstream>
+#include <sstream>
+#include <chrono>
 #include <filesystem>
+#include <iomanip>
 
-// NxNxN pixel size
-constexpr int N = 32;
-
-// Where to save images
-const std::string path = "./32x32x32/";
-
-// file name consist of prefix and the layer number
-const std::string file_prefix = "layer_";
-
-// No checks are done to ensure that OpenCV's imwrite() supports file extension.
-const std::string file_ext = ".png";
-
-// Sigma parameter of Gaussian kernel used for finding position of largest void/cluster
-static constexpr float SIGMA = 1.4;
+using namespace vc3d;
 
-// Size of filter.
-static constexpr int FILTER_SIZE = 17;
-
-// How to initialize random generator.
-// "use_random_device = false" will make reproducible noise by seeding random generator with 0
-//constexpr bool use_random_device = true;
-constexpr bool use_random_device = false;
-
-// Reporting frequency. No need to change this.
-//constexpr int REPORT_INTERVAL = -1; // for no reporting
-constexpr int REPORT_INTERVAL = 50;    // how often will progress be updated
-
-// In the original paper, for the initial phase authors choose 10% of points. For 3D this seems excessively high.
-// Additional heuristic, no regular cubic, fcc, hcp or bcc lattice should be possible ( != n^3, 2*n^3, 4*n^3 )
-constexpr int INITIAL_COUNT = (6 * 6 * 6 + 7 * 7 * 7) / 2;
+// Default options of the command line front end, in addition to generator Parameters (void-cluster-3d.hpp).
+// All of them can be changed at run time, from the command line or a config file, see usage().
+struct Options : Parameters
+{
+    // Where to save images. If empty, images are saved in "./<d0>x<d1>x<d2>/"
+    std::string path = "";
+
+    // file name consist of prefix and the layer number
+    std::string file_prefix = "layer_";
+
+    // No checks are done to ensure that OpenCV's imwrite() supports file extension.
+    std::string file_ext = ".png";
+
+    // Output format:
+    // "png"  layers of images, saved as file_prefix + layer number + file_ext. 8 bits only. Requires OpenCV.
+    // "raw"  single headerless file with all voxels, x fastest, then y, then z, little endian
+    // "dds"  single DDS 3D texture
+    // "ktx2" single KTX2 3D texture
+#ifdef VC3D_WITH_OPENCV
+    std::string format = "png";
+#else
+    std::string format = "raw";
+#endif
+
+    // Bits per voxel of volume formats: 8, 10 and 16 are unsigned normalized (10 in 16 bit words, raw only), 32 are
+    // float rank values in [0, 1)
+    int bits = 8;
+
+    // More volumes of the same texture, written in the same pass as the first: export_bits bit depths, and binary masks
+    // of the voxels of the lowest mask_thresholds fraction of ranks. Volume formats only. export_ranks adds the exact
+    // ranks, raw 32 bit unsigned whatever the format, for extend_exact.
+    std::vector<int> export_bits;
+    std::vector<float> mask_thresholds;
+    bool export_ranks = false;
+
+    // Show layers in a window when done, ESC to close. Requires OpenCV.
+    bool show = false;
+
+    // Progress is sampled every report_interval milliseconds, 0 or less for no reporting.
+    // "text" rewrites a line on the terminal, "json" prints a JSON object per sample and line, for other programs to read.
+    // Off by default in builds with VC3D_NO_PROGRESS, which have no progress to report.
+#if defined(VC3D_NO_PROGRESS)
+    int report_interval = -1;
+#else
+    int report_interval = 500;
+#endif
+    std::string progress_format = "text";
+
+    // Backend used for tracking of the largest void and cluster. All give identical results.
+    // "heap" keeps voids/clusters ordered on every update.
+    // "lazy" only finds the largest void/cluster when asked, by scanning. Build with AVX2 or NEON enabled for best results.
+    // "set" is the original std::set implementation, kept as reference.
+    // "device" keeps energies and tracking in a compute backend (DeviceMatrix), builds with VC3D_WITH_DEVICE only.
+    std::string tracker = "heap";
+
+    // Type of the energy field. All give blue noise, but not identical textures.
+    // "float"  the original
+    // "double" less rounding drift on long runs
+    // "fixed"  int32 fixed point, exact and independent of the order of additions, as much memory as float
+    std::string precision = "float";
+
+    // Batch mode: generate a texture for each of the seeds, jobs of them concurrently (0 = one per hardware thread).
+    // Textures are saved in "<path>/seed_<seed>/". Progress is not reported in batch mode.
+    std::vector<unsigned int> seeds;
+    int jobs = 0;
+
+    // Coarse to fine generation with levels > 1: the lowest prefix_fraction of the ranks of a texture of half the size
+    // are generated first (itself coarse to fine, with the filter halved), and upsampled into the prefix of the ranks of
+    // this one, instead of phase 1. About as fast as levels = 1: the prefix is prefix_fraction / 8 of the voxels, and
+    // larger fractions, which save more, degrade the patterns within the prefix. Sizes must be divisible by 2^(levels - 1).
+    int levels = 1;
+    float prefix_fraction = 0.1f;
+
+    // Partial generation: only the lowest ranks are generated, all other voxels get the rank ranks. -1 = all.
+    // extend continues from a volume saved with 32 bits, of the same size, instead of phase 1: its lowest extend_ranks
+    // ranks are kept (-1 = all the ranked voxels) and the others are generated with the current filter. With
+    // extend_exact, the volume holds the exact ranks of export_ranks instead, as it has to above 2^24 voxels, where
+    // rank values of neighbouring ranks are the same floats.
+    int ranks = -1;
+    std::string extend = "";
+    int extend_ranks = -1;
+    bool extend_exact = false;
+
+    // Checkpoints: the state is saved to the checkpoint file when each stage of phase 1 is done, and then every
+    // checkpoint_interval seconds, in the background. resume continues from a checkpoint file, with the same size and filter.
+    // Not available in batch mode.
+    std::string checkpoint = "";
+    int checkpoint_interval = 600;
+    std::string resume = "";
+
+    // Out of core: ranks and energies are kept in files mapped in memory, in the output directory, removed when saved.
+    // With raw 32 bit output the ranks file itself becomes the volume, converted in place instead of written again.
+    bool mapped = false;
+
+    // Preview: every preview of the ranks of phase 2 and 3, the voxels set so far are published (RankStream), and a
+    // thread of its own writes their mask to preview_mask.<format> in the output directory (raw for png), replacing
+    // the previous one. Generation does not wait for it. 0 = off. Not available in batch mode, nor for 2^32 voxels.
+    float preview = 0;
+
+    // Spectral analysis (void-cluster-3d-spectrum.hpp) of the patterns of the thresholds: spectrum saves spectrum.json
+    // with each texture generated, analyze instead analyzes a volume saved with 32 bits, of the same size, and prints it.
+    // Both are compared to the spectra of reference, a 32 bit volume of the same size, if given.
+    bool spectrum = false;
+    std::string analyze = "";
+    std::string reference = "";
+    std::vector<float> thresholds = { 0.1f, 0.25f, 0.5f };
+
+    // Instead of generating, measure splatting speed with 1, 2, 4, 8 and 16 threads on a volume of this size. 0 = off.
+    int scaling_benchmark_n = 0;
+
+    // Instead of generating, time each phase of a texture for every combination of these sizes (NxNxN), filter sizes
+    // and trackers, and print the results as JSON. No filter sizes means filter_size. Other parameters apply to all runs.
+    std::vector<int> benchmark_sizes;
+    std::vector<int> benchmark_filter_sizes;
+    std::vector<std::string> benchmark_trackers = { "heap", "lazy", "set" };
+
+    std::string output_path() const
+    {
+        return path.empty() ? "./" + std::to_string(d0) + "x" + std::to_string(d1) + "x" + std::to_string(d2) + "/" : path;
+    }
+};
 
-static void intro()
+static void intro(const Parameters& params)
 {
     std::cout << "Void-and-Cluster Method for Generating 3D Dither Arrays\n";
-    std::cout << "Generating: " << N << "x" << N << "x" << N << " texture\n\n";
+    std::cout << "Generating: " << params.d0 << "x" << params.d1 << "x" << params.d2 << " texture\n\n";
 }
 
-// percentage==100 will finish up progress output and reset static variables
-static void report_progress(int percentage)
+#ifdef VC3D_WITH_OPENCV
+// Rank values of a layer as OpenCV matrix
+static cv::Mat layer_to_mat(const RankMatrix3D& m, int layer)
 {
-    static const std::string prefix  = "Progress [";
-    static const std::string infix   = "] : ";
-    static const std::string postfix = "%";
-    static const std::vector<char> arr_progress_wheel = { '\\','|','/','-' };
-    static int   wheel_idx = -1;
-
-    static int progress_counter = 0;
-    static int last_percentage_reported = -1;
-
-
-    if (REPORT_INTERVAL <= 0)
-        return;
-
-    ++progress_counter;
-    if ( progress_counter % REPORT_INTERVAL != 0  &&  percentage != 100 )
-        return;
-
-
-    ++wheel_idx;
-    wheel_idx %= arr_progress_wheel.size();
-    const char progress_wheel = arr_progress_wheel[wheel_idx];
+    cv::Mat mat(m.dim1(), m.dim0(), CV_32FC1);
+    const uint32_t* ranks = m.data() + int64_t(layer) * m.dim0() * m.dim1();
+    std::transform(ranks, ranks + m.dim0() * m.dim1(), mat.ptr<float>(), [&](uint32_t rank) { return rank_value(rank, m.size()); });
+    return mat;
+}
 
-    if (last_percentage_reported == percentage)
+static void show(const RankMatrix3D& m, std::string window_name = "Layer")
+{
+    constexpr char ESC = 27;
+    cv::namedWindow(window_name, cv::WINDOW_NORMAL);
+    for (int layer = 0; layer < m.dim2(); ++layer)
     {
-        std::cout << progress_wheel << '\b';
+        imshow(window_name, layer_to_mat(m, layer));
+        char ch;
+        while ((ch=cv::waitKey())<0);
+        if (ch == ESC)
+            break;
     }
-    else if (percentage == 100)  // Finish reporting and reset static variables
+}
+
+// Levels are floor(rank * 256 / size), as in 8 bit volumes
+static void save_layers(const RankMatrix3D& mat3d, const std::string& path, const std::string& file_prefix, const std::string& file_ext)
+{
+    for (int layer = 0; layer < mat3d.dim2(); ++layer)
     {
-        std::string output = prefix + 'X' + infix + std::to_string(percentage) + postfix;
-        std::cout << '\r' << output << std::endl;
-        percentage = -1;
-        progress_counter = -1;
-        wheel_idx = -1;
+        cv::Mat mat_uchar(mat3d.dim1(), mat3d.dim0(), CV_8UC1);
+        const uint32_t* ranks = mat3d.data() + int64_t(layer) * mat3d.dim0() * mat3d.dim1();
+        std::transform(ranks, ranks + mat3d.dim0() * mat3d.dim1(), mat_uchar.ptr<uchar>(),
+            [&](uint32_t rank) { return static_cast<uchar>(quantize_rank(rank, mat3d.size(), 8)); });
+        cv::imwrite(path + file_prefix + std::to_string(layer) + file_ext, mat_uchar);
     }
-    else
+}
+#endif
+
+// Saves into directory path, returns path of the saved file(s). Volumes of all the bit depths and masks are written
+// in a single pass; without_first leaves out the volume of bits, e.g. when the ranks file of mapped becomes it.
+static std::string save(const RankMatrix3D& mat3d, const std::string& path, const Options& params, bool without_first = false)
+{
+    if (!std::filesystem::exists(path))
+        std::filesystem::create_directories(path);
+
+#ifdef VC3D_WITH_OPENCV
+    if (params.format == "png")
     {
-        std::string output = prefix + progress_wheel + infix + std::to_string(percentage) + postfix;
-        std::cout << '\r' << output << '\r' << prefix;
+        save_layers(mat3d, path, params.file_prefix, params.file_ext);
+        return path;
     }
-    std::cout.flush();
-
-    last_percentage_reported = percentage;
+#endif
+
+    std::vector<VolumeExport> targets;
+    for (const int bits : params.export_bits)
+        targets.push_back({ path + volume_file_name(mat3d, params.format, bits, true), bits, false, 0 });
+    for (const float threshold : params.mask_thresholds)
+        targets.push_back({ path + mask_file_name(mat3d, params.format, threshold), 8, true, threshold });
+    if (params.export_ranks)
+        targets.push_back({ path + ranks_file_name(mat3d), 32, false, 0, true });
+    const std::string file_name = path + volume_file_name(mat3d, params.format, params.bits);
+    if (!without_first)
+        targets.insert(targets.begin(), { file_name, params.bits, false, 0 });
+    if (!targets.empty())
+        export_volumes(mat3d, targets, params.format, params.threads);
+    return targets.size() > 1 ? path : file_name;
 }
 
-static void report_progress_unfinished(int percentage)
+// Spectra of the reference volume, none if there is no reference
+static std::vector<SpectrumProfile> reference_spectra(const Options& params)
 {
-    report_progress(std::min(percentage, 99));
+    if (params.reference.empty())
+        return {};
+    RankMatrix3D reference(params.d0, params.d1, params.d2);
+    load_volume(reference, params.reference);
+    return analyze_spectrum(reference, params.thresholds, params.threads);
 }
 
-static void report_progress_finished()
+template<class T>
+static void write_json_array(std::ostream& json, const std::vector<T>& values)
 {
-    report_progress(100);
+    json << "[";
+    for (size_t i = 0; i < values.size(); ++i)
+        json << (i > 0 ? ", " : "") << values[i];
+    json << "]";
 }
 
-
-using T3 = std::tuple<int, int, int>;
-
-static void mod(int& a, const int d)
+// Spectra of the thresholds as JSON, and their differences to the reference spectra, if any
+static std::string spectrum_json(const RankMatrix3D& mat3d, const Options& params, const std::vector<SpectrumProfile>& reference)
 {
-    a %= d;
-    a += d;
-    a %= d;
+    const std::vector<SpectrumProfile> profiles = analyze_spectrum(mat3d, params.thresholds, params.threads);
+    std::ostringstream json;
+    json << "{\"size\": [" << mat3d.dim0() << ", " << mat3d.dim1() << ", " << mat3d.dim2() << "], \"bin_width\": "
+         << 1.0 / std::max({ mat3d.dim0(), mat3d.dim1(), mat3d.dim2() }) << ", \"thresholds\": [";
+    for (size_t t = 0; t < profiles.size(); ++t)
+    {
+        const SpectrumProfile& profile = profiles[t];
+        json << (t > 0 ? "," : "") << "\n  {\"threshold\": " << profile.threshold << ", \"low_frequency_power\": " << profile.low_frequency_power;
+        if (!reference.empty())
+        {
+            const SpectrumComparison difference = compare_spectra(profile, reference[t]);
+            json << ", \"reference\": {\"low_frequency_power\": " << reference[t].low_frequency_power
+                 << ", \"low_frequency_power_ratio\": " << difference.low_frequency_power_ratio
+                 << ", \"power_rms_difference\": " << difference.power_rms_difference
+                 << ", \"power_max_difference\": " << difference.power_max_difference
+                 << ", \"anisotropy_mean_difference\": " << difference.anisotropy_mean_difference << "}";
+        }
+        json << ",\n   \"power\": ";
+        write_json_array(json, profile.power);
+        json << ",\n   \"anisotropy\": ";
+        write_json_array(json, profile.anisotropy);
+        json << "}";
+    }
+    json << "\n]}\n";
+    return json.str();
 }
 
-const T3 operator+(const T3& a, const T3& b)
+static void save_spectrum(const RankMatrix3D& mat3d, const std::string& path, const Options& params, const std::vector<SpectrumProfile>& reference)
 {
-    return { std::get<0>(a) + std::get<0>(b), 
-             std::get<1>(a) + std::get<1>(b), 
-             std::get<2>(a) + std::get<2>(b) };
+    std::filesystem::create_directories(path);
+    const std::string file_name = path + "spectrum.json";
+    std::ofstream file(file_name);
+    if (!(file << spectrum_json(mat3d, params, reference)) || !file.flush())
+        throw std::runtime_error("cannot write " + file_name);
 }
 
-const T3 operator-(const T3& a, const T3& b)
+// Prints the spectra of the volume to analyze instead of generating
+static void run_analysis(const Options& params)
 {
-    return { std::get<0>(a) - std::get<0>(b), 
-             std::get<1>(a) - std::get<1>(b), 
-             std::get<2>(a) - std::get<2>(b) };
+    RankMatrix3D mat3d(params.d0, params.d1, params.d2);
+    load_volume(mat3d, params.analyze);
+    std::cout << spectrum_json(mat3d, params, reference_spectra(params));
 }
 
-class Matrix3D
+// Times set/reset pairs at random positions (two splats and a largest void query each) for a range of thread counts
+template<class TrackedMatrix>
+static void scaling_benchmark(Options params)
 {
-public:
-    Matrix3D(int d0, int d1, int d2) :_d0(d0), _d1(d1), _d2(d2), _d01(d0* d1), _mat3D(d0* d1* d2), _size(d0* d1* d2) {};
+    constexpr int SPLAT_PAIRS = 2000;
+    const int n = params.scaling_benchmark_n;
+    params.d0 = params.d1 = params.d2 = n;
 
-    int size()  const               { return _size; };
-    int dim0()  const               { return _d0; };
-    int dim1()  const               { return _d1; };
-    int dim2()  const               { return _d2; };
+    std::cout << "Splatting " << params.filter_size << "x" << params.filter_size << "x" << params.filter_size_along_z() << " filter on "
+              << n << "x" << n << "x" << n << " volume\n";
+    std::cout << "threads\tms\tsplats/s\tspeedup\n";
 
-    //Mat to_mat(int layer) { return Mat(_d1, _d0, CV_32FC1, _arr.data() + layer * _d01); };
-    cv::Mat to_mat(int layer) const
+    double single_thread_ms = 0;
+    for (int threads : { 1, 2, 4, 8, 16 })
     {
-        const std::vector<float> _arr_copy(_mat3D.begin() + layer * _d01, _mat3D.begin() + (layer + 1) * _d01);
-        cv::Mat cv_mat(_arr_copy, true);
-        cv_mat=cv_mat.reshape(1, _d1);
-        return cv_mat;
+        params.threads = threads;
+        TrackedMatrix mat3d(params);
+
+        std::mt19937 gen(0);
+        std::uniform_int_distribution<> distr(0, n - 1);
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < SPLAT_PAIRS; ++i)
+        {
+            const T3 r(distr(gen), distr(gen), distr(gen));
+            mat3d.set_pixel(r, 0);
+            mat3d.reset_pixel(r);
+            mat3d.max_void();
+        }
+        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if (threads == 1)
+            single_thread_ms = ms;
+        std::cout << threads << '\t' << ms << '\t' << 2 * SPLAT_PAIRS / ms * 1000 << '\t' << single_thread_ms / ms << "\n";
     }
+}
 
-    float& at(const int idx)        { return _mat3D[idx]; };
-    float& at(const T3& t3)         { return _mat3D[T3_to_idx(t3)]; };
-    float get(const T3& t3) const   { return _mat3D[T3_to_idx(t3)]; };
+// Peak resident memory since the last reset_peak_memory(), -1 if unknown. Linux only.
+static void reset_peak_memory()
+{
+#if defined(__linux__)
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
 
+static long long peak_memory_bytes()
+{
+#if defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    while (status >> key)
+    {
+        if (key == "VmHWM:")
+        {
+            long long kb = -1;
+            status >> kb;
+            return kb < 0 ? -1 : kb * 1024;
+        }
+        status.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+#endif
+    return -1;
+}
 
-protected:
-    int T3_to_idx(const T3& t3) const
+static std::string json_string(const std::string& value)
+{
+    std::string quoted = "\"";
+    for (const char c : value)
     {
-        int i0 = std::get<0>(t3);
-        int i1 = std::get<1>(t3);
-        int i2 = std::get<2>(t3);
-        mod(i0, _d0);
-        mod(i1, _d1);
-        mod(i2, _d2);
-        return i0 + i1 * _d0 + i2 * _d01;
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        quoted += c;
     }
-    T3 idx_to_T3(const int idx) const
+    return quoted + "\"";
+}
+
+// Reports progress on std::cout every report_interval, until destroyed. nullptr if reporting is off.
+static std::unique_ptr<ProgressSampler> progress_sampler(const Progress& progress, const Options& params)
+{
+    if (params.report_interval <= 0)
+        return nullptr;
+
+    ProgressSampler::Report report;
+    if (params.progress_format == "json")
+        report = [](const ProgressSample& sample)
+        {
+            std::ostringstream line;
+            line << "{\"phase\": " << json_string(phase_name(sample.phase)) << ", \"placements\": " << sample.placements
+                 << ", \"total\": " << sample.total << ", \"reorder_swaps\": " << sample.reorder_swaps << ", \"seconds\": " << sample.seconds
+                 << ", \"rate\": " << sample.rate << ", \"eta_seconds\": ";
+            if (sample.eta_seconds < 0)
+                line << "null}";
+            else
+                line << sample.eta_seconds << "}";
+            std::cout << line.str() << std::endl;
+        };
+    else
+        report = [](const ProgressSample& sample)
+        {
+            std::ostringstream line;
+            line << "Progress " << phase_name(sample.phase) << ": " << sample.placements;
+            if (sample.total > 0)
+                line << "/" << sample.total << " (" << 100 * sample.placements / sample.total << "%)";
+            if (sample.phase == Phase::reorder_bitmap)
+                line << ", " << sample.reorder_swaps << " swaps";
+            else
+                line << ", " << std::lround(sample.rate) << " voxels/s";
+            if (sample.eta_seconds >= 0)
+                line << ", ETA " << std::lround(sample.eta_seconds) << " s";
+
+            std::cout << '\r' << std::left << std::setw(80) << line.str() << (sample.last ? "\n" : "") << std::flush;
+        };
+    return std::make_unique<ProgressSampler>(progress, std::chrono::milliseconds(params.report_interval), std::move(report));
+}
+
+// Ranks count .. end - 1 by phase_2_and_3, by tiled rounds if tiles > 1, or with a batched tail if void-batch > 1.
+// Rounds and batches stop before one would pass end, and the rest is ranked one by one at the last step only, so that
+// steps between checkpoints do not change the texture. Returns the count reached.
+template<class TrackedMatrix>
+static int64_t rank_voids(TrackedMatrix& mat3d, const Options& params, int64_t count, int64_t end, int64_t last)
+{
+    if (params.tiles > 1 || params.void_batch > 1)
     {
-        return { idx % _d0, (idx % _d01) / _d0, idx / _d01 };
+        if (params.tiles > 1)
+            count = phase_2_and_3_tiled(mat3d, params.tiles, count, end);
+        else
+            count = phase_2_and_3_batched(mat3d, params.void_batch, params.void_batch_start(), count, end);
+        if (end < last)
+            return count;
     }
-private:
-    const int _d0, _d1, _d2;
-    const int _d01;
-    const int _size;
-    std::vector<float> _mat3D;
-};
+    phase_2_and_3(mat3d, count, end);
+    return end;
+}
+
+// One run of the phases of a texture as a JSON object: wall time and work done by each phase, and peak memory
+template<class TrackedMatrix>
+static std::string benchmark(const Options& params)
+{
+    reset_peak_memory();
+    const unsigned int generator_seed = seed(params);
+    TrackedMatrix mat3d(params);
+    mat3d.reset(generator_seed);
+
+    std::ostringstream json;
+    json << "{\"size\": [" << params.d0 << ", " << params.d1 << ", " << params.d2 << "], \"filter_size\": " << params.filter_size
+         << ", \"filter_size_z\": " << params.filter_size_along_z()
+         << ", \"tracker\": " << json_string(params.tracker) << ", \"precision\": " << json_string(params.precision)
+         << ", \"threads\": " << params.threads << ", \"initial_count\": " << params.initial_count << ", \"phases\": [";
+
+    double total_seconds = 0;
+    const char* separator = "";
+    auto time_phase = [&](const char* name, auto phase)
+    {
+        mat3d.reset_statistics();
+        const auto start = std::chrono::steady_clock::now();
+        phase();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        total_seconds += seconds;
+
+        const Statistics& stats = mat3d.statistics();
+        auto per_second = [&](uint64_t count) { return seconds > 0 ? count / seconds : 0.0; };
+        json << separator << "{\"phase\": " << json_string(name) << ", \"seconds\": " << seconds
+             << ", \"placements\": " << stats.placements << ", \"placements_per_second\": " << per_second(stats.placements)
+             << ", \"splats\": " << stats.splats << ", \"taps\": " << stats.taps << ", \"taps_per_second\": " << per_second(stats.taps)
+             << ", \"tracker_operations\": " << stats.tracker_operations << "}";
+        separator = ", ";
+    };
+    time_phase("initial_bitmap",      [&] { initial_bitmap(mat3d, params.initial_count, generator_seed); });
+    time_phase("reorder_bitmap",      [&] { reorder_bitmap(mat3d, params.max_reorder_swaps); });
+    time_phase("rank_initial_bitmap", [&] { rank_initial_bitmap(mat3d, params.initial_count); });
+    time_phase("phase_2_and_3",       [&] { rank_voids(mat3d, params, params.initial_count, mat3d.size(), mat3d.size()); });
+
+    const long long peak_memory = peak_memory_bytes();
+    json << "], \"seconds\": " << total_seconds << ", \"peak_memory_bytes\": ";
+    if (peak_memory < 0)
+        json << "null}";
+    else
+        json << peak_memory << "}";
 
+    std::cerr << params.d0 << "x" << params.d1 << "x" << params.d2 << ", filter " << params.filter_size << ", "
+              << params.tracker << ": " << total_seconds << " s\n";
+    return json.str();
+}
 
-static Matrix3D GaussianMatrix(int size, float sigma);
+// Ranks between checkpoints in phase 2, the interval is checked that often
+constexpr int CHECKPOINT_STEP = 1024;
 
+template<class TrackedMatrix>
+static void generate(TrackedMatrix& mat3d, const Options& params, unsigned int seed, RankStream* stream = nullptr);
 
-unsigned int seed()
+// Ranks of the texture of half the size, to be upsampled into the next level: only its lowest prefix_fraction of ranks
+// are generated, the others are given the same rank (rank_rest). The filter is the same in space as the next level's,
+// half of it in coarse voxels, with about an eighth of the taps.
+template<class TrackedMatrix>
+static RankMatrix3D generate_coarse(Options params, unsigned int seed, Progress& progress)
 {
-    std::random_device rd;
-    return use_random_device ? rd() : 0;
+    params.d0 /= 2;
+    params.d1 /= 2;
+    params.d2 /= 2;
+    params.ranks = static_cast<int64_t>(std::ceil(double(params.prefix_fraction) * params.size()));
+    auto half_size = [](int filter_size) { return std::max(3, filter_size / 2 | 1); };
+    params.filter_size = half_size(params.filter_size);
+    params.sigma /= 2;
+    if (params.filter_size_z > 0)
+        params.filter_size_z = half_size(params.filter_size_z);
+    params.sigma_z /= 2;
+    params.levels -= 1;
+    params.tiles = 1;       // coarse levels are small, and may be too thin for the tiles
+    params.void_batch = 1;
+    params.ranks_file.clear();
+    params.energies_file.clear();
+    params.checkpoint.clear();
+    params.resume.clear();
+
+    TrackedMatrix mat3d(params);
+    mat3d.report_progress_to(progress);
+    mat3d.reset(seed);
+    generate(mat3d, params, seed);
+    return mat3d;
 }
 
-class Matrix3D_w_void_and_cluster_tracking : public Matrix3D
+// phase_1 (or the upsampled coarse level) and phase_2_and_3, resumed from the snapshot and checkpointed if requested.
+// Phase 2 and 3 are published to stream, if given, every params.preview of the ranks.
+template<class TrackedMatrix>
+static void generate(TrackedMatrix& mat3d, const Options& params, unsigned int seed, RankStream* stream)
 {
-public:
-    Matrix3D_w_void_and_cluster_tracking(int d0, int d1, int d2): 
-        Matrix3D(d0, d1, d2),
-        weights(d0,d1,d2),
-        filter{ GaussianMatrix(FILTER_SIZE, SIGMA) }
+    Stage stage = Stage::initial_bitmap;
+    int64_t count = params.initial_count;
+    if (!params.resume.empty())
     {
-        small_randomization();
-        void_initialization();
-    };
+        Snapshot snapshot;
+        read_snapshot(params.resume, snapshot);
+        check_compatible(snapshot, params);
+        restore(mat3d, snapshot);
+        stage = snapshot.stage;
+        count = snapshot.count;
+        std::cout << "Resuming from " << params.resume << "\n";
+    }
 
-    void set_pixel(const T3& t3, float value)
+    std::unique_ptr<Checkpointer> checkpointer;
+    if (!params.checkpoint.empty())
+        checkpointer = std::make_unique<Checkpointer>(params.checkpoint);
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    auto checkpoint = [&]
     {
-        if (at(t3) > 0)
-            throw std::runtime_error("already set");
+        if (!checkpointer)
+            return;
+        checkpointer->submit(mat3d, params, stage, count);
+        last_checkpoint = std::chrono::steady_clock::now();
+    };
 
-        at(t3) = value;
-        add_to_cluster(t3);
-        conv_at(t3);
-    }
-    void reset_pixel(const T3& t3)
+    if (stage == Stage::initial_bitmap && !params.extend.empty())
     {
-        at(t3) = 0;
-        add_to_void(t3);
-        deconv_at(t3);
+        RankMatrix3D ranks(params.d0, params.d1, params.d2);
+        if (params.extend_exact)
+            load_ranks(ranks, params.extend);
+        else
+            load_volume(ranks, params.extend);
+        count = place_ranked_prefix(mat3d, ranks, params.extend_ranks);
+        stage = Stage::phase_2_and_3;
+        checkpoint();
     }
-
-    void remove_tracking(const T3& t3)
+    if (stage == Stage::initial_bitmap && params.levels > 1)
     {
-        const int idx = T3_to_idx(t3);
-        _track_void.erase({ weights.at(idx), idx });
-        _track_cluster.erase({ weights.at(idx), idx });
+        const RankMatrix3D coarse = generate_coarse<TrackedMatrix>(params, seed, mat3d.progress());
+        count = rank_upsampled_prefix(mat3d, coarse, params.prefix_fraction);
+        stage = Stage::phase_2_and_3;
+        checkpoint();
     }
-    void cluster_tracking_off()
+    if (stage == Stage::initial_bitmap)
     {
-        _cluster_tracking_is_on = false;
-        _track_cluster.clear();
+        initial_bitmap(mat3d, params.initial_count, seed);
+        stage = Stage::reorder_bitmap;
+        checkpoint();
     }
-
-    const T3   max_void()    const { return idx_to_T3(_track_void.cbegin()->second); };
-    const T3   max_cluster() const { return idx_to_T3(_track_cluster.crbegin()->second); };
-
-
-protected:
-    Matrix3D weights;
-
-    const Matrix3D filter;
-
-    std::set<std::pair<float, int>> _track_void;
-    std::set<std::pair<float, int>> _track_cluster;
-    void add_to_void(const T3& t3)
+    if (stage == Stage::reorder_bitmap)
     {
-        const int idx = T3_to_idx(t3);
-        _track_cluster.erase({ weights.at(idx), idx });
-        _track_void.insert({ weights.at(idx), idx });
+        reorder_bitmap(mat3d, params.max_reorder_swaps);
+        stage = Stage::rank_initial_bitmap;
+        checkpoint();
     }
-    void add_to_cluster(const T3& t3)
+    if (stage == Stage::rank_initial_bitmap)
     {
-
-        const int idx = T3_to_idx(t3);
-        auto was_tracked = _track_void.erase({ weights.at(idx), idx });
-        if (was_tracked && _cluster_tracking_is_on)
-            _track_cluster.insert({ weights.at(idx), idx });
+        rank_initial_bitmap(mat3d, params.initial_count);
+        stage = Stage::phase_2_and_3;
+        checkpoint();
     }
-    void update(const T3& t3, float value)
+
+    const auto interval = std::chrono::seconds(params.checkpoint_interval);
+    const int64_t last = params.ranks < 0 ? mat3d.size() : params.ranks;
+    const int64_t preview_step = stream ? std::max<int64_t>(1, static_cast<int64_t>(double(params.preview) * mat3d.size())) : 0;
+    int64_t next_preview = stream ? (count / preview_step + 1) * preview_step : last;
+    while (count < last)
     {
-        int idx = T3_to_idx(t3);
-        if (at(idx) != 0)
+        const int64_t step = std::max({ CHECKPOINT_STEP, params.tiles, params.void_batch });
+        int64_t end = checkpointer ? std::min(count + step, last) : last;
+        if (stream)
+            end = std::min(end, std::max(next_preview, std::min(count + step, last)));
+        count = rank_voids(mat3d, params, count, end, last);
+        if (stream && count >= next_preview)
         {
-            auto was_tracked = _track_cluster.erase({ weights.at(idx), idx });
-            weights.at(idx) += value;
-            if (was_tracked && _cluster_tracking_is_on)
-                _track_cluster.insert({weights.at(idx), idx});
+            stream->publish(mat3d, count);
+            next_preview = (count / preview_step + 1) * preview_step;
         }
-        else
-        {
-            auto was_tracked = _track_void.erase({ weights.at(idx), idx });
-            weights.at(idx) += value;
-            if (was_tracked)
-                _track_void.insert({ weights.at(idx), idx });
+        if (count < last && std::chrono::steady_clock::now() - last_checkpoint >= interval)
+            checkpoint();
+    }
+    if (last < mat3d.size())
+        rank_rest(mat3d, last);
 
-        }
+    if (checkpointer)
+    {
+        const std::string error = checkpointer->flush();
+        if (!error.empty())
+            std::cout << "Exception while checkpointing: " << error << std::endl;
+    }
+}
+
+// Writes the mask of the voxels set in each frame of the stream to file_name, on a thread of its own, until destroyed.
+// Each mask goes to a temporary file first, renamed over the previous one.
+class PreviewWriter
+{
+public:
+    PreviewWriter(RankStream& stream, std::string file_name, std::string format) :
+        _subscription(stream),
+        _file_name(std::move(file_name)),
+        _format(std::move(format)),
+        _writer([this] { writer_loop(); })
+    {};
+    ~PreviewWriter()
+    {
+        _stop = true;
+        _writer.join();
     };
+    PreviewWriter(const PreviewWriter&) = delete;
+    PreviewWriter& operator=(const PreviewWriter&) = delete;
 
-    void conv_at(const T3& r)
+private:
+    // Once stopped, writes the frame still waiting, if any, and returns
+    void writer_loop()
     {
-        const T3 center(filter.dim0() / 2, filter.dim1() / 2, filter.dim2() / 2);
-        for (int g2 = 0; g2 < filter.dim2(); ++g2)
-        for (int g1 = 0; g1 < filter.dim1(); ++g1)
-        for (int g0 = 0; g0 < filter.dim0(); ++g0)
+        while (true)
         {
-            const T3 g(g0, g1, g2);
-            filter.get(g);
-            update(r + g - center, filter.get(g));
+            const bool stop = _stop;
+            const auto frame = _subscription.wait_next(std::chrono::milliseconds(stop ? 0 : 100));
+            if (!frame)
+            {
+                if (stop)
+                    return;
+                continue;
+            }
+            try
+            {
+                // Unset voxels have UNSET_RANK, above all the ranks of fewer than 2^32 voxels, which are below size
+                const std::string temp_name = _file_name + ".tmp";
+                export_volumes(frame->ranks, { { temp_name, 8, true, 1.0f } }, _format);
+                std::filesystem::rename(temp_name, _file_name);
+            }
+            catch (const std::exception& ex)
+            { std::cout << "Exception while writing the preview: " << ex.what() << std::endl; }
         }
     }
-    void deconv_at(const T3& r)
+
+    RankStream::Subscription _subscription;
+    const std::string _file_name;
+    const std::string _format;
+    std::atomic<bool> _stop{ false };
+    std::thread _writer;    // last, starts once everything else is constructed
+};
+
+// Removes the files it is given when destroyed, if they still exist, e.g. the scratch files of mapped when generating
+// or saving throws
+class ScratchFiles
+{
+public:
+    ScratchFiles() = default;
+    ~ScratchFiles()
     {
-        const T3 center(filter.dim0() / 2, filter.dim1() / 2, filter.dim2() / 2);
-        for (int g2 = 0; g2 < filter.dim2(); ++g2)
-        for (int g1 = 0; g1 < filter.dim1(); ++g1)
-        for (int g0 = 0; g0 < filter.dim0(); ++g0)
+        for (const std::string& file_name : _file_names)
         {
-            const T3 g(g0, g1, g2);
-            update(r + g - center, -filter.get(g));
+            std::error_code error;
+            std::filesystem::remove(file_name, error);
         }
-    }
+    };
+    ScratchFiles(const ScratchFiles&) = delete;
+    ScratchFiles& operator=(const ScratchFiles&) = delete;
 
+    void add(const std::string& file_name) { _file_names.push_back(file_name); };
 
-    bool _cluster_tracking_is_on{ true };
+private:
+    std::vector<std::string> _file_names;
+};
 
+// e.g. preview_mask.dds, or preview_mask_64x64x64_u8.bin for raw and png
+static std::string preview_file_name(const Options& params)
+{
+    if (params.format == "dds" || params.format == "ktx2")
+        return "preview_mask." + params.format;
+    return "preview_mask_" + std::to_string(params.d0) + "x" + std::to_string(params.d1) + "x" + std::to_string(params.d2) + "_u8.bin";
+}
 
-    void small_randomization()
+template<class TrackedMatrix>
+static void run(const Options& params)
+{
+    if (params.scaling_benchmark_n > 0)
     {
-        float EPS = 1e-7;
+        scaling_benchmark<TrackedMatrix>(params);
+        return;
+    }
 
-        std::mt19937 gen(seed());
-        std::uniform_real_distribution<> distr(0, EPS);
+    intro(params);
 
-        for (int i2 = 0; i2 < weights.dim2(); ++i2)
-            for (int i1 = 0; i1 < weights.dim1(); ++i1)
-                for (int i0 = 0; i0 < weights.dim0(); ++i0)
-                    weights.at({ i0,i1,i2 }) = distr(gen);
+    const std::vector<SpectrumProfile> reference = params.spectrum ? reference_spectra(params) : std::vector<SpectrumProfile>();
+    const unsigned int generator_seed = seed(params);
+    if (params.use_random_device)
+        std::cout << "Seed: " << generator_seed << " (--seed " << generator_seed << " generates the same texture)\n";
+    const std::string path = params.output_path();
+    Options storage = params;
+    ScratchFiles scratch;       // destroyed after mat3d, i.e. once the files are unmapped
+    if (params.mapped)
+    {
+        std::filesystem::create_directories(path);
+        storage.ranks_file = path + "ranks.tmp";
+        storage.energies_file = path + "energies.tmp";
+        scratch.add(storage.ranks_file);
+        scratch.add(storage.energies_file);
+    }
+    TrackedMatrix mat3d(storage);
+    mat3d.reset(generator_seed);
+    {
+        std::unique_ptr<RankStream> stream;
+        std::unique_ptr<PreviewWriter> preview;
+        if (params.preview > 0)
+        {
+            std::filesystem::create_directories(path);
+            stream = std::make_unique<RankStream>(params.d0, params.d1, params.d2);
+            preview = std::make_unique<PreviewWriter>(*stream, path + preview_file_name(params), params.format == "png" ? "raw" : params.format);
+        }
+        const auto sampler = progress_sampler(mat3d.progress(), params);
+        generate(mat3d, params, generator_seed, stream.get());
     }
 
-    void void_initialization()
+    try 
     {
-        for (int i2 = 0; i2 < weights.dim2(); ++i2)
-            for (int i1 = 0; i1 < weights.dim1(); ++i1)
-                for (int i0 = 0; i0 < weights.dim0(); ++i0)
-                    add_to_void({ i0,i1,i2 });
+        if (params.spectrum)
+            save_spectrum(mat3d, path, params, reference);
+        std::string saved;
+        if (params.mapped && params.format == "raw" && params.bits == 32)
+        {
+            save(mat3d, path, params, true);
+            ranks_to_rank_values(mat3d);
+            saved = path + volume_file_name(mat3d, params.format, params.bits);
+            std::filesystem::rename(storage.ranks_file, saved);
+        }
+        else
+            saved = save(mat3d, path, params);
+        std::cout << "Files saved in: " << saved << "\n";
     }
+    catch (const std::exception& ex)
+    { std::cout << "Exception while saving: " << ex.what() << std::endl; }
 
-};
+#ifdef VC3D_WITH_OPENCV
+    if (params.show)
+        show(mat3d);
+#endif
+}
 
-static void show(const Matrix3D& m, std::string window_name = "Layer");
+// Generates a texture per seed, each saved in "<path>/seed_<seed>/" as soon as it is done.
+// Every job reuses one matrix (and the filter shared by all) for all the seeds it generates.
+template<class TrackedMatrix>
+static void run_batch(const Options& params)
+{
+    intro(params);
+
+    const auto filter = make_filter(params);
+    const std::vector<SpectrumProfile> reference = params.spectrum ? reference_spectra(params) : std::vector<SpectrumProfile>();
+    const int seed_count = static_cast<int>(params.seeds.size());
+    const int jobs = std::min(params.jobs > 0 ? params.jobs : static_cast<int>(std::max(1u, std::thread::hardware_concurrency())), seed_count);
+    std::cout << seed_count << " textures, " << jobs << " at a time\n";
+
+    std::atomic<int> next_seed{ 0 };
+    std::atomic<int> done{ 0 };
+    std::mutex output_mutex;
+    ThreadPool pool(jobs);
+    // Exceptions must not leave the workers: they are reported, and the job goes on with its next seed
+    pool.run([&](int)
+    {
+        std::unique_ptr<TrackedMatrix> job_matrix;
+        try
+        { job_matrix = std::make_unique<TrackedMatrix>(params, filter); }
+        catch (const std::exception& ex)
+        {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "Exception while starting a job, its textures are left to the others: " << ex.what() << std::endl;
+            return;
+        }
+        auto& mat3d = *job_matrix;
+        for (int i = next_seed++; i < seed_count; i = next_seed++)
+        {
+            const unsigned int seed = params.seeds[i];
+            std::string message;
+            try
+            {
+                mat3d.reset(seed);
+                generate(mat3d, params, seed);
+            }
+            catch (const std::exception& ex)
+            { message = "Exception while generating seed " + std::to_string(seed) + ": " + ex.what(); }
+
+            const std::string path = params.output_path() + "seed_" + std::to_string(seed) + "/";
+            if (message.empty())
+            {
+                try
+                {
+                    message = "Files saved in: " + save(mat3d, path, params);
+                    if (params.spectrum)
+                        save_spectrum(mat3d, path, params, reference);
+                }
+                catch (const std::exception& ex)
+                { message = "Exception while saving seed " + std::to_string(seed) + ": " + ex.what(); }
+            }
+
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "[" << ++done << "/" << seed_count << "] " << message << std::endl;
+        }
+    });
+}
 
-static int dist2(int i0, int i1, int i2)
+static void usage()
 {
-    return (i0 * i0 + i1 * i1 + i2 * i2);
+    const Options defaults;
+    std::cout <<
+        "Usage: void-cluster-3d [options]\n"
+        "  --size N | D0xD1xD2         texture size (default " << defaults.d0 << "x" << defaults.d1 << "x" << defaults.d2 << ")\n"
+        "  --path DIR                  where to save images (default ./D0xD1xD2/)\n"
+        "  --file-prefix PREFIX        image file name prefix (default " << defaults.file_prefix << ")\n"
+        "  --file-ext EXT              image file extension (default " << defaults.file_ext << ")\n"
+        "  --format png|raw|dds|ktx2   layers of images (OpenCV builds only), or a single volume file (default " << defaults.format << ")\n"
+        "  --bits 8|10|16|32           bits per voxel of volume formats, 10 raw only (default " << defaults.bits << ")\n"
+        "  --export-bits LIST          more bit depths saved in the same pass, e.g. 10,16\n"
+        "  --masks LIST                also save binary masks of these fractions of the lowest ranks, e.g. 0.1,0.5\n"
+        "  --export-ranks              also save the exact ranks, raw 32 bit unsigned, for --extend-exact\n"
+        "  --show                      show layers when done, ESC to close (OpenCV builds only)\n"
+        "  --sigma S                   sigma of Gaussian filter (default " << defaults.sigma << ")\n"
+        "  --filter-size K             size of filter, odd (default " << defaults.filter_size << ")\n"
+        "  --sigma-z S                 sigma of the filter along z, e.g. when z is time (default: sigma)\n"
+        "  --filter-size-z K           size of the filter along z, odd (default: filter-size)\n"
+        "  --kernel-tolerance T        skip filter taps below T, relative to the center (default " << defaults.kernel_tolerance << ")\n"
+        "  --initial-count C           number of points in the initial pattern (default " << defaults.initial_count << ")\n"
+        "  --max-reorder-swaps N       stop reordering the initial pattern after N swaps, -1 for no limit (default " << defaults.max_reorder_swaps << ")\n"
+        "  --fft-initialization        energy of the initial pattern by FFT, faster for large initial counts\n"
+        "  --seed S                    seed of random generator (default " << defaults.seed << ")\n"
+        "  --random-device             seed random generator from std::random_device instead\n"
+        "  --report-interval MS        milliseconds between progress reports, -1 for no reporting (default " << defaults.report_interval << ")\n"
+        "  --progress-format text|json progress as a terminal line, or as a JSON object per line (default " << defaults.progress_format << ")\n"
+        "  --tracker heap|lazy|set     void/cluster tracking backend, or device if built with it (default " << defaults.tracker << ")\n"
+        "  --precision P               energy field type: float, double or fixed (default " << defaults.precision << ")\n"
+        "  --threads T                 threads used for splatting (default " << defaults.threads << ")\n"
+        "  --tiles S                   rank the voids of S slabs along z concurrently, S even, 1 for off (default " << defaults.tiles << ")\n"
+        "  --void-batch K              from void-batch-from on, place up to K voids whose splats share no z-plane concurrently (default " << defaults.void_batch << ")\n"
+        "  --void-batch-from F         fraction of the ranks after which voids are batched (default " << defaults.void_batch_from << ")\n"
+        "  --seeds LIST                batch mode, generate a texture per seed, e.g. 0-99 or 1,5,7\n"
+        "  --jobs J                    textures generated concurrently in batch mode (default: hardware threads)\n"
+        "  --levels L                  coarse to fine generation over L levels, each of twice the size, about as fast as 1 (default " << defaults.levels << ")\n"
+        "  --prefix-fraction F         fraction of the ranks of a coarse level upsampled into the next one (default " << defaults.prefix_fraction << ")\n"
+        "  --ranks K                   generate the lowest K ranks only, the other voxels get rank K (default: all)\n"
+        "  --extend FILE               continue from the ranks of FILE, a 32 bit volume of the same size, instead of phase 1\n"
+        "  --extend-ranks K            ranks kept from the extended volume (default: all ranked voxels)\n"
+        "  --extend-exact              FILE holds exact ranks, as saved by --export-ranks, required above 2^24 voxels\n"
+        "  --checkpoint FILE           save the state to FILE while generating, to resume from\n"
+        "  --checkpoint-interval S     seconds between checkpoints (default " << defaults.checkpoint_interval << ")\n"
+        "  --resume FILE               continue generation from checkpoint FILE\n"
+        "  --spectrum                  save spectrum.json, spectra of the thresholds, with each texture\n"
+        "  --mapped                    keep ranks and energies in files mapped in memory, for volumes larger than memory\n"
+        "  --preview F                 write the mask of the voxels set so far every F of the ranks while generating (default: off)\n"
+        "  --analyze FILE              print the spectra of FILE, a 32 bit volume of the same size, instead of generating\n"
+        "  --reference FILE            compare spectra to those of FILE, a 32 bit volume of the same size\n"
+        "  --thresholds LIST           fractions of the voxels in the patterns analyzed (default 0.1,0.25,0.5)\n"
+        "  --scaling-benchmark N       measure splatting speed on NxNxN volume instead of generating\n"
+        "  --benchmark LIST            time each phase on NxNxN volumes, e.g. 32,64, and print JSON instead of generating\n"
+        "  --benchmark-filter-sizes L  filter sizes of the benchmark, e.g. 9,17 (default: filter-size)\n"
+        "  --benchmark-trackers L      trackers of the benchmark (default heap,lazy,set)\n"
+        "  --config FILE               read options from FILE, one \"option value\" per line, without leading --\n"
+        "  --help                      show this message\n";
 }
 
-static Matrix3D GaussianMatrix(int size, float sigma)
+// std::stoi & co. accept trailing garbage and throw without context
+template<class T, class Convert>
+static T parse_number(const std::string& key, const std::string& value, Convert convert)
 {
-    assert(size % 2 == 1);
+    size_t end = 0;
+    T result{};
+    try
+    { result = static_cast<T>(convert(value, &end)); }
+    catch (const std::logic_error&)
+    { end = std::string::npos; }
+
+    if (end != value.size())
+        throw std::invalid_argument(key + ": invalid value: " + value);
+    return result;
+}
 
-    Matrix3D g(size,size, size);
+static int parse_int(const std::string& key, const std::string& value)
+{
+    return parse_number<int>(key, value, [](const std::string& v, size_t* end) { return std::stoi(v, end); });
+}
 
-    const int center0 = g.dim0() / 2;
-    const int center1 = g.dim1() / 2;
-    const int center2 = g.dim2() / 2;
+static unsigned int parse_unsigned(const std::string& key, const std::string& value)
+{
+    return parse_number<unsigned int>(key, value, [](const std::string& v, size_t* end) { return std::stoul(v, end); });
+}
 
-    const float inv_sigma2 = 1 / (2 * sigma * sigma);
-    for (int i2 = 0; i2 < g.dim2(); ++i2)
-    for (int i1 = 0; i1 < g.dim1(); ++i1)
-    for (int i0 = 0; i0 < g.dim0(); ++i0)
-        g.at({ i0, i1, i2 }) = exp(-dist2(i0 - center0, i1 - center1, i2 - center2) * inv_sigma2);
+static float parse_float(const std::string& key, const std::string& value)
+{
+    return parse_number<float>(key, value, [](const std::string& v, size_t* end) { return std::stof(v, end); });
+}
 
-    return g;
-};
+static void parse_size(const std::string& value, Options& params)
+{
+    const size_t x0 = value.find('x');
+    if (x0 == std::string::npos)
+    {
+        params.d0 = params.d1 = params.d2 = parse_int("size", value);
+        return;
+    }
+    const size_t x1 = value.find('x', x0 + 1);
+    if (x1 == std::string::npos)
+        throw std::invalid_argument("size: expected N or D0xD1xD2: " + value);
+    params.d0 = parse_int("size", value.substr(0, x0));
+    params.d1 = parse_int("size", value.substr(x0 + 1, x1 - x0 - 1));
+    params.d2 = parse_int("size", value.substr(x1 + 1));
+}
+
+static std::vector<std::string> split_list(const std::string& value)
+{
+    std::vector<std::string> items;
+    std::istringstream list(value);
+    std::string item;
+    while (std::getline(list, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+// Comma separated numbers, e.g. "9,17"
+static std::vector<int> parse_int_list(const std::string& key, const std::string& value)
+{
+    std::vector<int> numbers;
+    for (const std::string& item : split_list(value))
+        numbers.push_back(parse_int(key, item));
+    return numbers;
+}
+
+static std::vector<float> parse_float_list(const std::string& key, const std::string& value)
+{
+    std::vector<float> numbers;
+    for (const std::string& item : split_list(value))
+        numbers.push_back(parse_float(key, item));
+    return numbers;
+}
 
-static void initial_bitmap(Matrix3D_w_void_and_cluster_tracking& mat3d, int count)
+// Adds seed unless already listed, so that no two textures are saved in the same directory
+static void add_seed(unsigned int seed, Options& params)
 {
-    std::mt19937 gen(seed());
-    std::uniform_int_distribution<> distr0(0, mat3d.dim0() - 1);
-    std::uniform_int_distribution<> distr1(0, mat3d.dim1() - 1);
-    std::uniform_int_distribution<> distr2(0, mat3d.dim2() - 1);
+    if (std::find(params.seeds.begin(), params.seeds.end(), seed) == params.seeds.end())
+        params.seeds.push_back(seed);
+}
 
-    while (count > 0)
+// Comma separated seeds or ranges of seeds, e.g. "0-9,20,30-39"
+static void parse_seeds(const std::string& value, Options& params)
+{
+    std::istringstream list(value);
+    std::string item;
+    while (std::getline(list, item, ','))
     {
-        const int i0 = distr0(gen);
-        const int i1 = distr1(gen);
-        const int i2 = distr2(gen);
-        const T3 r(i0, i1, i2);
-        if (mat3d.get(r) == 0)
+        const size_t dash = item.find('-');
+        if (dash == std::string::npos)
         {
-            --count;
-            mat3d.set_pixel({ i0, i1, i2 }, 1);
+            add_seed(parse_unsigned("seeds", item), params);
+            continue;
         }
-        report_progress_unfinished(0);
+        const unsigned int first = parse_unsigned("seeds", item.substr(0, dash));
+        const unsigned int last  = parse_unsigned("seeds", item.substr(dash + 1));
+        if (last < first)
+            throw std::invalid_argument("seeds: invalid range: " + item);
+        for (unsigned int seed = first; seed <= last && seed >= first; ++seed)
+            add_seed(seed, params);
     }
 }
 
-static void reorder_bitmap(Matrix3D_w_void_and_cluster_tracking& mat3d)
-{
-    while (true)
-    {
-        const auto t_max = mat3d.max_cluster();
-        mat3d.reset_pixel(t_max);
-
-        const auto t_min = mat3d.max_void();
-        mat3d.set_pixel(t_min, 1);
+static void parse_config_file(const std::string& file_name, Options& params);
 
-        report_progress_unfinished(0);
+// Options without value are flags
+static void set_parameter(const std::string& key, const std::string& value, Options& params)
+{
+    if      (key == "size")              parse_size(value, params);
+    else if (key == "path")              params.path = value;
+    else if (key == "file-prefix")       params.file_prefix = value;
+    else if (key == "file-ext")          params.file_ext = value;
+    else if (key == "format")            params.format = value;
+    else if (key == "bits")              params.bits = parse_int(key, value);
+    else if (key == "export-bits")       params.export_bits = parse_int_list(key, value);
+    else if (key == "masks")             params.mask_thresholds = parse_float_list(key, value);
+    else if (key == "export-ranks")      params.export_ranks = value.empty() || value == "true" || value == "1";
+    else if (key == "sigma")             params.sigma = parse_float(key, value);
+    else if (key == "filter-size")       params.filter_size = parse_int(key, value);
+    else if (key == "sigma-z")           params.sigma_z = parse_float(key, value);
+    else if (key == "filter-size-z")     params.filter_size_z = parse_int(key, value);
+    else if (key == "kernel-tolerance")  params.kernel_tolerance = parse_float(key, value);
+    else if (key == "initial-count")     params.initial_count = parse_int(key, value);
+    else if (key == "max-reorder-swaps") params.max_reorder_swaps = parse_int(key, value);
+    else if (key == "fft-initialization") params.fft_initialization = value.empty() || value == "true" || value == "1";
+    else if (key == "seed")              params.seed = parse_unsigned(key, value);
+    else if (key == "random-device")     params.use_random_device = value.empty() || value == "true" || value == "1";
+    else if (key == "show")              params.show = value.empty() || value == "true" || value == "1";
+    else if (key == "report-interval")   params.report_interval = parse_int(key, value);
+    else if (key == "progress-format")   params.progress_format = value;
+    else if (key == "tracker")           params.tracker = value;
+    else if (key == "precision")         params.precision = value;
+    else if (key == "threads")           params.threads = parse_int(key, value);
+    else if (key == "tiles")             params.tiles = parse_int(key, value);
+    else if (key == "void-batch")        params.void_batch = parse_int(key, value);
+    else if (key == "void-batch-from")   params.void_batch_from = parse_float(key, value);
+    else if (key == "seeds")             parse_seeds(value, params);
+    else if (key == "jobs")              params.jobs = parse_int(key, value);
+    else if (key == "levels")            params.levels = parse_int(key, value);
+    else if (key == "prefix-fraction")   params.prefix_fraction = parse_float(key, value);
+    else if (key == "ranks")             params.ranks = parse_int(key, value);
+    else if (key == "extend")            params.extend = value;
+    else if (key == "extend-ranks")      params.extend_ranks = parse_int(key, value);
+    else if (key == "extend-exact")      params.extend_exact = value.empty() || value == "true" || value == "1";
+    else if (key == "checkpoint")        params.checkpoint = value;
+    else if (key == "checkpoint-interval") params.checkpoint_interval = parse_int(key, value);
+    else if (key == "resume")            params.resume = value;
+    else if (key == "spectrum")          params.spectrum = value.empty() || value == "true" || value == "1";
+    else if (key == "mapped")            params.mapped = value.empty() || value == "true" || value == "1";
+    else if (key == "preview")           params.preview = parse_float(key, value);
+    else if (key == "analyze")           params.analyze = value;
+    else if (key == "reference")         params.reference = value;
+    else if (key == "thresholds")        params.thresholds = parse_float_list(key, value);
+    else if (key == "scaling-benchmark") params.scaling_benchmark_n = parse_int(key, value);
+    else if (key == "benchmark")         params.benchmark_sizes = parse_int_list(key, value);
+    else if (key == "benchmark-filter-sizes") params.benchmark_filter_sizes = parse_int_list(key, value);
+    else if (key == "benchmark-trackers") params.benchmark_trackers = split_list(value);
+    else if (key == "config")            parse_config_file(value, params);
+    else
+        throw std::invalid_argument("unknown option: " + key);
+}
 
-        if (t_min == t_max)
-            break;
-    }
+static bool is_flag(const std::string& key)
+{
+    return key == "random-device" || key == "show" || key == "fft-initialization" || key == "spectrum" || key == "mapped" ||
+        key == "export-ranks" || key == "extend-exact" || key == "help";
 }
 
-static void rank_initial_bitmap(Matrix3D_w_void_and_cluster_tracking& mat3d, int count)
+static void parse_config_file(const std::string& file_name, Options& params)
 {
-    while (count > 0)
+    std::ifstream file(file_name);
+    if (!file)
+        throw std::invalid_argument("cannot open config file: " + file_name);
+
+    std::string line;
+    while (std::getline(file, line))
     {
-        --count;
-        
-        const auto t_max = mat3d.max_cluster();
-        mat3d.reset_pixel(t_max);
-        mat3d.set_pixel(t_max, (float)count / mat3d.size());
-        mat3d.remove_tracking(t_max);
-        report_progress_unfinished(0);
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string key, value;
+        if (!(words >> key))
+            continue;
+        words >> value;
+        set_parameter(key, value, params);
     }
 }
 
-static void phase_1(Matrix3D_w_void_and_cluster_tracking& mat3d, int count)
+// Trackers of this build
+static bool is_tracker(const std::string& tracker)
 {
-    initial_bitmap(mat3d, count);
-    reorder_bitmap(mat3d);
-    rank_initial_bitmap(mat3d, count);
+#ifdef VC3D_WITH_DEVICE
+    if (tracker == "device")
+        return true;
+#endif
+    return tracker == "heap" || tracker == "lazy" || tracker == "set";
 }
 
-// No need for separate phase 1 and phase 2
-// Minimum void 
-static void phase_2_and_3(Matrix3D_w_void_and_cluster_tracking& mat3d, int count)
+static void validate(const Options& params)
 {
-    mat3d.cluster_tracking_off();
-    for (; count < mat3d.size(); ++count)
+    if (params.d0 <= 0 || params.d1 <= 0 || params.d2 <= 0)
+        throw std::invalid_argument("size must be positive");
+    if (params.size() > (int64_t(1) << 32) || int64_t(params.d0) * params.d1 > std::numeric_limits<int>::max())
+        throw std::invalid_argument("size must be at most 2^32 voxels, and 2^31 per plane");
+    if (params.filter_size <= 0 || params.filter_size % 2 == 0)
+        throw std::invalid_argument("filter-size must be positive and odd");
+    if (params.sigma <= 0)
+        throw std::invalid_argument("sigma must be positive");
+    if (params.filter_size_z < 0 || (params.filter_size_z > 0 && params.filter_size_z % 2 == 0))
+        throw std::invalid_argument("filter-size-z must be positive and odd");
+    if (params.sigma_z < 0)
+        throw std::invalid_argument("sigma-z must be positive");
+    if (params.kernel_tolerance < 0 || params.kernel_tolerance >= 1)
+        throw std::invalid_argument("kernel-tolerance must be in [0, 1)");
+    if (params.initial_count <= 0 || params.initial_count >= params.size())
+        throw std::invalid_argument("initial-count must be positive and smaller than the texture");
+    if (params.max_reorder_swaps < -1)
+        throw std::invalid_argument("max-reorder-swaps must be -1 or more");
+    if (params.format != "png" && params.format != "raw" && params.format != "dds" && params.format != "ktx2")
+        throw std::invalid_argument("format must be png, raw, dds or ktx2");
+    std::vector<int> all_bits = params.export_bits;
+    all_bits.push_back(params.bits);
+    for (const int bits : all_bits)
     {
-        const auto t_min = mat3d.max_void();
-        mat3d.set_pixel(t_min, (float)count / mat3d.size());
-
-        report_progress_unfinished(100*count/mat3d.size());
+        if (bits != 8 && bits != 10 && bits != 16 && bits != 32)
+            throw std::invalid_argument("bits must be 8, 10, 16 or 32");
+        if (bits == 10 && params.format != "raw")
+            throw std::invalid_argument("10 bits are raw only");
+        if (std::count(all_bits.begin(), all_bits.end(), bits) > 1)
+            throw std::invalid_argument("export-bits must differ from each other and from bits");
+    }
+    if (params.format == "png" && (params.bits != 8 || !params.export_bits.empty() || !params.mask_thresholds.empty() || params.export_ranks))
+        throw std::invalid_argument("png format supports 8 bits only, without export-bits, masks or export-ranks");
+    for (const float threshold : params.mask_thresholds)
+        if (!(threshold > 0 && threshold < 1))
+            throw std::invalid_argument("masks must be in (0, 1)");
+#ifndef VC3D_WITH_OPENCV
+    if (params.format == "png" || params.show)
+        throw std::invalid_argument("png format and show require OpenCV, this build is without it");
+#endif
+    if (params.progress_format != "text" && params.progress_format != "json")
+        throw std::invalid_argument("progress-format must be text or json");
+    if (!is_tracker(params.tracker))
+        throw std::invalid_argument("tracker must be heap, lazy or set, or device in builds with VC3D_WITH_DEVICE");
+    if (params.tracker == "device" && (params.mapped || params.fft_initialization))
+        throw std::invalid_argument("tracker device is not available with mapped or fft-initialization");
+    if (params.precision != "float" && params.precision != "double" && params.precision != "fixed")
+        throw std::invalid_argument("precision must be float, double or fixed");
+    if (params.threads <= 0)
+        throw std::invalid_argument("threads must be positive");
+    if (params.tiles != 1 && (params.tiles < 2 || params.tiles % 2 != 0 || params.d2 / params.tiles < params.filter_size_along_z() - 1))
+        throw std::invalid_argument("tiles must be 1, or even and at most size along z / (filter size along z - 1)");
+    if (params.void_batch <= 0)
+        throw std::invalid_argument("void-batch must be positive");
+    if (params.void_batch > 1 && params.tiles > 1)
+        throw std::invalid_argument("void-batch and tiles cannot be combined");
+    if (params.void_batch_from < 0 || params.void_batch_from > 1)
+        throw std::invalid_argument("void-batch-from must be in [0, 1]");
+    if (params.jobs < 0)
+        throw std::invalid_argument("jobs must not be negative");
+    if (params.levels <= 0)
+        throw std::invalid_argument("levels must be positive");
+    const int coarsest = 1 << (params.levels - 1);
+    if (params.d0 % coarsest != 0 || params.d1 % coarsest != 0 || params.d2 % coarsest != 0)
+        throw std::invalid_argument("size must be divisible by 2^(levels - 1)");
+    if (params.levels > 1 && params.initial_count >= params.size() / coarsest / coarsest / coarsest)
+        throw std::invalid_argument("initial-count must be smaller than the coarsest level");
+    if (params.prefix_fraction <= 0 || params.prefix_fraction > 1)
+        throw std::invalid_argument("prefix-fraction must be in (0, 1]");
+    if (params.ranks < -1 || params.ranks > params.size())
+        throw std::invalid_argument("ranks must be -1, or from 0 to the size of the texture");
+    if (params.extend_ranks < -1 || params.extend_ranks > params.size())
+        throw std::invalid_argument("extend-ranks must be -1, or from 0 to the size of the texture");
+    if (!params.extend.empty() && (params.levels > 1 || !params.seeds.empty()))
+        throw std::invalid_argument("extend is not available with levels or in batch mode");
+    if (!params.extend.empty() && !params.extend_exact && params.size() > (int64_t(1) << 24))
+        throw std::invalid_argument("extend needs extend-exact and ranks saved with export-ranks above 2^24 voxels, "
+            "whose 32 bit rank values are not exact");
+    if (params.extend_exact && params.extend.empty())
+        throw std::invalid_argument("extend-exact needs extend");
+    if (params.checkpoint_interval < 0)
+        throw std::invalid_argument("checkpoint-interval must not be negative");
+    if (!params.seeds.empty() && (!params.checkpoint.empty() || !params.resume.empty()))
+        throw std::invalid_argument("checkpoint and resume are not available in batch mode");
+    if (params.mapped && (!params.seeds.empty() || !params.checkpoint.empty() || !params.resume.empty() || params.show || params.fft_initialization))
+        throw std::invalid_argument("mapped is not available in batch mode, with checkpoint, resume, show or fft-initialization");
+    if (params.preview < 0 || params.preview > 1)
+        throw std::invalid_argument("preview must be in [0, 1]");
+    if (params.preview > 0 && !params.seeds.empty())
+        throw std::invalid_argument("preview is not available in batch mode");
+    if (params.preview > 0 && params.size() >= (int64_t(1) << 32))
+        throw std::invalid_argument("preview is available for fewer than 2^32 voxels");
+    if (params.thresholds.empty())
+        throw std::invalid_argument("thresholds must not be empty");
+    for (const float threshold : params.thresholds)
+        if (!(threshold > 0 && threshold < 1))
+            throw std::invalid_argument("thresholds must be in (0, 1)");
+    if (!params.benchmark_sizes.empty())
+    {
+        if (params.levels > 1 || !params.seeds.empty() || !params.checkpoint.empty() || !params.resume.empty() || params.mapped)
+            throw std::invalid_argument("benchmark runs single level textures, without batch, checkpoint, resume or mapped");
+        for (const int n : params.benchmark_sizes)
+            if (n <= 0 || params.initial_count >= int64_t(n) * n * n)
+                throw std::invalid_argument("benchmark sizes must be positive and larger than initial-count");
+        for (const int filter_size : params.benchmark_filter_sizes)
+            if (filter_size <= 0 || filter_size % 2 == 0)
+                throw std::invalid_argument("benchmark filter sizes must be positive and odd");
+        if (params.benchmark_trackers.empty())
+            throw std::invalid_argument("benchmark-trackers must not be empty");
+        for (const std::string& tracker : params.benchmark_trackers)
+        {
+            if (!is_tracker(tracker))
+                throw std::invalid_argument("benchmark-trackers must be heap, lazy or set, or device in builds with VC3D_WITH_DEVICE");
+            if (tracker == "device" && params.fft_initialization)
+                throw std::invalid_argument("tracker device is not available with fft-initialization");
+        }
     }
-    report_progress_finished();
 }
 
-static void show(const Matrix3D& m, std::string window_name)
+// Returns false if only usage was requested
+static bool parse_command_line(int argc, char* argv[], Options& params)
 {
-    constexpr char ESC = 27;
-    cv::namedWindow(window_name, cv::WINDOW_NORMAL);
-    for (int layer = 0; layer < m.dim2(); ++layer)
+    for (int i = 1; i < argc; ++i)
     {
-        imshow(window_name, m.to_mat(layer));
-        char ch;
-        while ((ch=cv::waitKey())<0);
-        if (ch == ESC)
-            break;
+        const std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+            throw std::invalid_argument("unexpected argument: " + arg);
+
+        const std::string key = arg.substr(2);
+        if (key == "help")
+            return false;
+        if (is_flag(key))
+        {
+            set_parameter(key, "", params);
+            continue;
+        }
+        if (i + 1 >= argc)
+            throw std::invalid_argument(key + ": missing value");
+        set_parameter(key, argv[++i], params);
     }
+    validate(params);
+    return true;
 }
 
+// Matrices of each tracker, by energy type
+template<class Energy> using HeapMatrix = Matrix3D_w_void_and_cluster_tracking<HeapTracker, Energy>;
+template<class Energy> using LazyMatrix = Matrix3D_w_void_and_cluster_tracking<LazyTracker, Energy>;
+template<class Energy> using SetMatrix  = Matrix3D_w_void_and_cluster_tracking<SetTracker, Energy>;
+#ifdef VC3D_WITH_DEVICE
+template<class Energy> using HostBackendMatrix = DeviceMatrix<HostBackend<Energy>>;
+#endif
 
-static void save(const Matrix3D& mat3d, std::string path)
+template<template<class> class MatrixOf>
+static void run_with_precision(const Options& params, bool batch)
 {
-    if (!std::filesystem::exists(path))
-        std::filesystem::create_directory(path);
+    if (params.precision == "double")
+        batch ? run_batch<MatrixOf<double>>(params) : run<MatrixOf<double>>(params);
+    else if (params.precision == "fixed")
+        batch ? run_batch<MatrixOf<int32_t>>(params) : run<MatrixOf<int32_t>>(params);
+    else
+        batch ? run_batch<MatrixOf<float>>(params) : run<MatrixOf<float>>(params);
+}
 
-    for (int layer = 0; layer < mat3d.dim2(); ++layer)
-    {
-        cv::Mat mat_float = mat3d.to_mat(layer);
-        cv::Mat mat_uchar;
-        mat_float.convertTo(mat_uchar,  CV_8UC1, 256);
-        cv::imwrite(path + file_prefix + std::to_string(layer) + file_ext, mat_uchar);
-    }
+template<template<class> class MatrixOf>
+static std::string benchmark_with_precision(const Options& params)
+{
+    if (params.precision == "double")
+        return benchmark<MatrixOf<double>>(params);
+    if (params.precision == "fixed")
+        return benchmark<MatrixOf<int32_t>>(params);
+    return benchmark<MatrixOf<float>>(params);
+}
 
-    std::cout << "Files saved in: " << path << "\n";
+static std::string benchmark_with_tracker(const Options& params)
+{
+#ifdef VC3D_WITH_DEVICE
+    if (params.tracker == "device")
+        return benchmark_with_precision<HostBackendMatrix>(params);
+#endif
+    if (params.tracker == "lazy")
+        return benchmark_with_precision<LazyMatrix>(params);
+    if (params.tracker == "set")
+        return benchmark_with_precision<SetMatrix>(params);
+    return benchmark_with_precision<HeapMatrix>(params);
 }
 
-int main()
-{    
-    intro();
+// Prints a JSON document with the build and a run for each combination of size, filter size and tracker
+static void run_benchmarks(Options params)
+{
+#if defined(__AVX2__)
+    const std::string simd = "avx2";
+#elif defined(__ARM_NEON)
+    const std::string simd = "neon";
+#else
+    const std::string simd = "none";
+#endif
+#if defined(__VERSION__)
+    const std::string compiler = __VERSION__;
+#elif defined(_MSC_VER)
+    const std::string compiler = "MSVC " + std::to_string(_MSC_VER);
+#else
+    const std::string compiler = "unknown";
+#endif
+    std::cout << "{\"build\": {\"compiler\": " << json_string(compiler) << ", \"simd\": " << json_string(simd) << "},\n \"runs\": [";
+
+    const std::vector<int> filter_sizes = params.benchmark_filter_sizes.empty() ? std::vector<int>{ params.filter_size } : params.benchmark_filter_sizes;
+    const char* separator = "\n  ";
+    for (const int n : params.benchmark_sizes)
+        for (const int filter_size : filter_sizes)
+            for (const std::string& tracker : params.benchmark_trackers)
+            {
+                params.d0 = params.d1 = params.d2 = n;
+                params.filter_size = filter_size;
+                params.tracker = tracker;
+                const std::string run = benchmark_with_tracker(params);
+                std::cout << separator << run << std::flush;
+                separator = ",\n  ";
+            }
+    std::cout << "\n]}" << std::endl;
+}
 
-    Matrix3D_w_void_and_cluster_tracking mat3d(N, N, N);
-    phase_1(mat3d, INITIAL_COUNT);
-    phase_2_and_3(mat3d, INITIAL_COUNT);
+int main(int argc, char* argv[])
+{    
+    Options params;
+    try
+    {
+        if (!parse_command_line(argc, argv, params))
+        {
+            usage();
+            return 0;
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << "Error: " << ex.what() << "\n\n";
+        usage();
+        return 1;
+    }
 
-    try 
-    { save(mat3d, path); }
-    catch (const cv::Exception& ex)
-    { std::cout << "Exception while saving layers: " << ex.what() << std::endl; }
+    const bool batch = !params.seeds.empty();
 
-    show(mat3d);
+    try
+    {
+        if (!params.analyze.empty())
+            run_analysis(params);
+        else if (!params.benchmark_sizes.empty())
+            run_benchmarks(params);
+#ifdef VC3D_WITH_DEVICE
+        else if (params.tracker == "device")
+            run_with_precision<HostBackendMatrix>(params, batch);
+#endif
+        else if (params.tracker == "lazy")
+            run_with_precision<LazyMatrix>(params, batch);
+        else if (params.tracker == "set")
+            run_with_precision<SetMatrix>(params, batch);
+        else
+            run_with_precision<HeapMatrix>(params, batch);
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
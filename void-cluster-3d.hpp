@@ -0,0 +1,2222 @@
+// Generating 3D dithering pattern (blue noise) following the paper of R. Ulichney (1993)
+//
+// The 2D algorithm presented in the paper is verbatim generalized to 3D.
+// 
+// R. Ulichney, “The Void-and-Cluster Method for Generating Dither Arrays”,
+// Human Vision, Visual Processing, and Digital Display IV, J. Allebach and B. Rogowitz, eds., Proc. SPIE 1913, pp. 332-343, 1993.
+// Author's version of the paper can be found at: http://cv.ulichney.com/papers/1993-void-cluster.pdf
+// 
+// Header only library, the generator itself. Command line front end is in void-cluster-3d.cpp
+// 
+// USAGE:  Matrix3D_w_void_and_cluster_tracking<> mat3d(params);
+//         phase_1(mat3d, params.initial_count, seed(params));
+//         phase_2_and_3(mat3d, params.initial_count);
+//         mat3d then holds the rank of each voxel, rank_value() gives rank / size
+//
+//         or, to generate textures again and again without allocating (see VoidClusterGenerator):
+//         VoidClusterGenerator<> generator(params);
+//         generator.generate(seed);
+//         generator.copy_ranks(buffer.data(), buffer.size());
+// 
+// DEPENDENCY: STD only. Tested with C++17  
+// 
+// Caveat. Phase 3 is mathematically no different than Phase 2, thus, those 2 are merged together
+// (Finding largest cluster center of zeros, is equivalent to finding largest void center of ones)
+// 
+//
+
+#pragma once
+
+#include <vector>
+#include <numeric>
+#include <string>
+#include <iostream>
+#include <random>
+#include <cmath>
+#include <cassert>
+#include <stdexcept>
+#include <tuple>
+#include <set>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <complex>
+#include <limits>
+#include <type_traits>
+#include <array>
+#include <functional>
+#include <chrono>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace vc3d
+{
+
+// Default parameters of the generator
+struct Parameters
+{
+    // d0 x d1 x d2 pixel size
+    int d0 = 32, d1 = 32, d2 = 32;
+
+    // Sigma parameter of Gaussian kernel used for finding position of largest void/cluster
+    float sigma = 1.4f;
+
+    // Size of filter.
+    int filter_size = 17;
+
+    // Sigma and size of the filter along z can differ from x and y, e.g. when z is time. 0 = same as sigma / filter_size.
+    float sigma_z = 0;
+    int filter_size_z = 0;
+
+    // Filter taps smaller than kernel_tolerance (relative to the center tap) are skipped, and the filter is shrunk accordingly.
+    // e.g. 1e-7 for float precision, or 1e-4 for a much faster run. 0 keeps the whole filter_size cube.
+    float kernel_tolerance = 0;
+
+    // How to initialize random generator.
+    // "use_random_device = false" will make reproducible noise by seeding random generator with seed
+    bool use_random_device = false;
+    unsigned int seed = 0;
+
+    // In the original paper, for the initial phase authors choose 10% of points. For 3D this seems excessively high.
+    // Additional heuristic, no regular cubic, fcc, hcp or bcc lattice should be possible ( != n^3, 2*n^3, 4*n^3 )
+    int initial_count = (6 * 6 * 6 + 7 * 7 * 7) / 2;
+
+    // Threads used for adding the filter (splatting). Pays off for large N and filters, e.g. N >= 64.
+    int threads = 1;
+
+    // Tiled phase 2 and 3 (phase_2_and_3_tiled) with tiles slabs along z, each placing its largest void in turn, which
+    // threads do concurrently. 1 = off. Much faster for large volumes, but not the same texture as the default.
+    int tiles = 1;
+
+    // Batched tail of phase 2 and 3 (phase_2_and_3_batched): from rank void_batch_from * size on, each step places up
+    // to void_batch of the largest voids, whose splats share no plane, concurrently. 1 = off. Not the same texture.
+    int void_batch = 1;
+    float void_batch_from = 0.5f;
+    int64_t void_batch_start() const { return static_cast<int64_t>(std::ceil(double(void_batch_from) * size())); };
+
+    // Swaps of the initial pattern's reorder are stopped after that many, -1 for no limit
+    int max_reorder_swaps = -1;
+
+    // Ranks and energies in files mapped in memory (MappedFile) if given, for volumes larger than memory. Files are
+    // created or resized, and kept. Trackers stay in memory, LazyTracker needs the least: about a byte per voxel.
+    std::string ranks_file = "";
+    std::string energies_file = "";
+
+    // Energy of the initial pattern by FFT convolution instead of splatting point by point. Pays off for high initial
+    // densities (e.g. the paper's 10%), but energies differ by rounding, so textures are not identical to the default.
+    bool fft_initialization = false;
+
+    int64_t size() const { return int64_t(d0) * d1 * d2; };
+    float sigma_along_z() const     { return sigma_z > 0 ? sigma_z : sigma; };
+    int filter_size_along_z() const { return filter_size_z > 0 ? filter_size_z : filter_size; };
+};
+
+// Phases of a generation, as reported by Progress
+enum class Phase : int { idle, initial_bitmap, reorder_bitmap, rank_initial_bitmap, rank_upsampled_prefix, place_ranked_prefix, phase_2_and_3, done };
+
+inline const char* phase_name(Phase phase)
+{
+    switch (phase)
+    {
+    case Phase::initial_bitmap:         return "initial_bitmap";
+    case Phase::reorder_bitmap:         return "reorder_bitmap";
+    case Phase::rank_initial_bitmap:    return "rank_initial_bitmap";
+    case Phase::rank_upsampled_prefix:  return "rank_upsampled_prefix";
+    case Phase::place_ranked_prefix:    return "place_ranked_prefix";
+    case Phase::phase_2_and_3:          return "phase_2_and_3";
+    case Phase::done:                   return "done";
+    default:                            return "idle";
+    }
+}
+
+// Progress of a generation: updated by the phase functions on the generating thread, and read from any other thread,
+// e.g. by a ProgressSampler. Updates are relaxed stores, and are compiled out if VC3D_NO_PROGRESS is defined.
+struct Progress
+{
+    std::atomic<Phase>    phase{ Phase::idle };
+    std::atomic<uint64_t> placements{ 0 };      // voxels placed in the current phase, of total
+    std::atomic<uint64_t> total{ 0 };           // 0 if not known in advance (reorder_bitmap)
+    std::atomic<uint64_t> reorder_swaps{ 0 };
+
+    // One writer only, so no read-modify-write is needed
+    void start(Phase new_phase, uint64_t done, uint64_t of)
+    {
+#if !defined(VC3D_NO_PROGRESS)
+        placements.store(done, std::memory_order_relaxed);
+        total.store(of, std::memory_order_relaxed);
+        phase.store(new_phase, std::memory_order_release);
+#else
+        (void)new_phase; (void)done; (void)of;
+#endif
+    }
+    void placed(uint64_t count = 1)
+    {
+#if !defined(VC3D_NO_PROGRESS)
+        placements.store(placements.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+#else
+        (void)count;
+#endif
+    }
+    void swapped()
+    {
+#if !defined(VC3D_NO_PROGRESS)
+        reorder_swaps.store(reorder_swaps.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#endif
+    }
+    void reset()
+    {
+        start(Phase::idle, 0, 0);
+#if !defined(VC3D_NO_PROGRESS)
+        reorder_swaps.store(0, std::memory_order_relaxed);
+#endif
+    }
+};
+
+struct ProgressSample
+{
+    Phase phase = Phase::idle;
+    uint64_t placements = 0, total = 0, reorder_swaps = 0;
+    double seconds = 0;             // since the sampler started
+    double rate = 0;                // placements per second since the previous sample
+    double eta_seconds = -1;        // until the end of the phase at that rate, negative if unknown
+    bool last = false;              // taken when the sampler is destroyed, e.g. unwinding from an exception
+};
+
+// Calls report with a sample of progress every interval, from a thread of its own, and once more when destroyed.
+// Nothing is reported from the generating thread, so report can be slow, e.g. write to a file or a socket.
+class ProgressSampler
+{
+public:
+    using Report = std::function<void(const ProgressSample&)>;
+
+    ProgressSampler(const Progress& progress, std::chrono::milliseconds interval, Report report) :
+        _progress(progress),
+        _interval(interval),
+        _report(std::move(report)),
+        _start(std::chrono::steady_clock::now()),
+        _thread([this] { sampler_loop(); })
+    {};
+    ~ProgressSampler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _thread.join();
+        ProgressSample s = sample();
+        s.last = true;
+        _report(s);
+    };
+    ProgressSampler(const ProgressSampler&) = delete;
+    ProgressSampler& operator=(const ProgressSampler&) = delete;
+
+private:
+    void sampler_loop()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_wake.wait_for(lock, _interval, [&] { return _stop; }))
+        {
+            lock.unlock();
+            _report(sample());
+            lock.lock();
+        }
+    }
+
+    ProgressSample sample()
+    {
+        ProgressSample s;
+        s.phase = _progress.phase.load(std::memory_order_acquire);
+        s.placements = _progress.placements.load(std::memory_order_relaxed);
+        s.total = _progress.total.load(std::memory_order_relaxed);
+        s.reorder_swaps = _progress.reorder_swaps.load(std::memory_order_relaxed);
+        s.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+
+        // A new phase counts its placements from the start, done keeps those of phase_2_and_3
+        const bool same_count = s.phase == _last.phase || s.phase == Phase::done;
+        const uint64_t previous = same_count && s.placements >= _last.placements ? _last.placements : 0;
+        if (s.seconds > _last.seconds)
+            s.rate = (s.placements - previous) / (s.seconds - _last.seconds);
+        if (s.rate > 0 && s.total >= s.placements)
+            s.eta_seconds = (s.total - s.placements) / s.rate;
+        _last = s;
+        return s;
+    }
+
+    const Progress& _progress;
+    const std::chrono::milliseconds _interval;
+    const Report _report;
+    const std::chrono::steady_clock::time_point _start;
+    ProgressSample _last;           // sampler thread only, and the destructor once it is joined
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stop{ false };
+    std::thread _thread;            // last, starts once everything else is constructed
+};
+
+
+using T3 = std::tuple<int, int, int>;
+
+inline void mod(int& a, const int d)
+{
+    a %= d;
+    a += d;
+    a %= d;
+}
+
+inline const T3 operator+(const T3& a, const T3& b)
+{
+    return { std::get<0>(a) + std::get<0>(b), 
+             std::get<1>(a) + std::get<1>(b), 
+             std::get<2>(a) + std::get<2>(b) };
+}
+
+inline const T3 operator-(const T3& a, const T3& b)
+{
+    return { std::get<0>(a) - std::get<0>(b), 
+             std::get<1>(a) - std::get<1>(b), 
+             std::get<2>(a) - std::get<2>(b) };
+}
+
+// Allocates storage aligned to cache lines. Arrays of 2 MB or more are aligned to 2 MB and, on Linux, asked to be
+// backed by transparent huge pages: a splat touches rows of up to filter_size planes, which are far apart for large
+// sizes, and with 4 KB pages most of those rows would take a TLB miss.
+template<class T>
+struct MatrixAllocator
+{
+    using value_type = T;
+    static constexpr size_t CACHE_LINE = 64;
+    static constexpr size_t HUGE_PAGE = size_t(1) << 21;
+
+    MatrixAllocator() = default;
+    template<class U> MatrixAllocator(const MatrixAllocator<U>&) {};
+
+    T* allocate(size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+        void* p = ::operator new(bytes, alignment(bytes));
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (bytes >= HUGE_PAGE)
+            madvise(p, bytes / HUGE_PAGE * HUGE_PAGE, MADV_HUGEPAGE);  // only advice, fine if refused
+#endif
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t n)     { ::operator delete(p, alignment(n * sizeof(T))); };
+
+    template<class U> bool operator==(const MatrixAllocator<U>&) const { return true; };
+    template<class U> bool operator!=(const MatrixAllocator<U>&) const { return false; };
+
+private:
+    static std::align_val_t alignment(size_t bytes) { return std::align_val_t(bytes >= HUGE_PAGE ? HUGE_PAGE : CACHE_LINE); };
+};
+
+// File mapped in memory for reading and writing, of bytes bytes: created, or resized, first. Pages are read from the
+// file when touched and written back to it by the system, so the file can be larger than memory. The file is kept
+// when unmapped. POSIX only.
+class MappedFile
+{
+public:
+    MappedFile(const std::string& file_name, size_t bytes) : _bytes(bytes)
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = ::open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + file_name);
+        if (::ftruncate(fd, off_t(bytes)) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("cannot resize " + file_name);
+        }
+        void* p = ::mmap(nullptr, std::max<size_t>(bytes, 1), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);    // the mapping keeps the file open
+        if (p == MAP_FAILED)
+            throw std::runtime_error("cannot map " + file_name);
+        _data = p;
+#else
+        throw std::runtime_error("cannot map " + file_name + ", memory mapped files need POSIX");
+#endif
+    };
+    ~MappedFile()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        ::munmap(_data, std::max<size_t>(_bytes, 1));
+#endif
+    };
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    void* data() const { return _data; };
+
+private:
+    const size_t _bytes;
+    void* _data{ nullptr };
+};
+
+// d0 x d1 x d2 values of type T, x fastest, on a torus. See MatrixAllocator for the storage, or MappedFile if a file
+// is given. Indices are 64 bit, as volumes can have more than 2^31 voxels, e.g. 1291^3; planes have fewer.
+template<class T>
+class BasicMatrix3D
+{
+public:
+    using value_type = T;
+
+    BasicMatrix3D(int d0, int d1, int d2, const std::string& file_name = "") :
+        _d0(d0), _d1(d1), _d2(d2), _d01(d0* d1), _size(int64_t(d0)* d1* d2),
+        _mat3D(file_name.empty() ? _size : 0),
+        _mapped(file_name.empty() ? nullptr : std::make_unique<MappedFile>(file_name, _size * sizeof(T))),
+        _data(_mapped ? static_cast<T*>(_mapped->data()) : _mat3D.data())
+    {};
+    // Copies are in memory, whatever the storage of other
+    BasicMatrix3D(const BasicMatrix3D& other) :
+        _d0(other._d0), _d1(other._d1), _d2(other._d2), _d01(other._d01), _size(other._size),
+        _mat3D(other.data(), other.data() + other.size()),
+        _data(_mat3D.data())
+    {};
+    BasicMatrix3D(BasicMatrix3D&& other) noexcept :
+        _d0(other._d0), _d1(other._d1), _d2(other._d2), _d01(other._d01), _size(other._size),
+        _mat3D(std::move(other._mat3D)),
+        _mapped(std::move(other._mapped)),
+        _data(other._data)
+    {};
+
+    int64_t size() const            { return _size; };
+    int dim0()  const               { return _d0; };
+    int dim1()  const               { return _d1; };
+    int dim2()  const               { return _d2; };
+
+    T&       at(const int64_t idx)  { return _data[idx]; };
+    T        get(const int64_t idx) const { return _data[idx]; };
+    T&       at(const T3& t3)       { return _data[T3_to_idx(t3)]; };
+    T        get(const T3& t3) const { return _data[T3_to_idx(t3)]; };
+
+    T*       data()                 { return _data; };
+    const T* data() const           { return _data; };
+
+    void fill(T value)              { std::fill(_data, _data + _size, value); };
+
+
+protected:
+    int64_t T3_to_idx(const T3& t3) const
+    {
+        int i0 = std::get<0>(t3);
+        int i1 = std::get<1>(t3);
+        int i2 = std::get<2>(t3);
+        mod(i0, _d0);
+        mod(i1, _d1);
+        mod(i2, _d2);
+        return i0 + i1 * _d0 + i2 * int64_t(_d01);
+    }
+    T3 idx_to_T3(const int64_t idx) const
+    {
+        const int in_plane = static_cast<int>(idx % _d01);
+        return { in_plane % _d0, in_plane / _d0, static_cast<int>(idx / _d01) };
+    }
+private:
+    const int _d0, _d1, _d2;
+    const int _d01;
+    const int64_t _size;
+    std::vector<T, MatrixAllocator<T>> _mat3D;     // empty if mapped
+    std::unique_ptr<MappedFile> _mapped;
+    T* _data;
+};
+
+// Rank values (rank / size) and the float energy field
+using Matrix3D = BasicMatrix3D<float>;
+// Ranks 0 .. size - 1 of a generated texture
+using RankMatrix3D = BasicMatrix3D<uint32_t>;
+
+// Rank as a value in [0, 1), as saved
+inline float rank_value(uint32_t rank, int64_t size)
+{
+    return (float)rank / size;
+}
+
+// One bit per voxel, packed in 64 bit words
+class Bitset
+{
+public:
+    explicit Bitset(int64_t size) : _words((size + 63) / 64) {};
+
+    bool test(int64_t idx) const    { return (_words[idx >> 6] >> (idx & 63)) & 1; };
+    void set(int64_t idx)           { _words[idx >> 6] |= uint64_t(1) << (idx & 63); };
+    void reset(int64_t idx)         { _words[idx >> 6] &= ~(uint64_t(1) << (idx & 63)); };
+    void clear()                { std::fill(_words.begin(), _words.end(), 0); };
+
+private:
+    std::vector<uint64_t> _words;
+};
+
+
+inline Matrix3D GaussianMatrix(int size0, int size1, int size2, float sigma0, float sigma1, float sigma2);
+
+// Gaussian filter stored as a sparse list of taps, in raster order of its bounding box.
+// Taps below tolerance (relative to the center tap) are dropped. Gaussian is separable,
+// so the support along each axis follows from the 1D profile exp(-i^2 / (2 sigma^2)).
+// Sigma and size can differ per axis, e.g. along z when it is time: the filter is then the product of a spatial
+// Gaussian and a temporal one, and a narrow z extent makes splats touch fewer planes.
+class GaussianKernel
+{
+public:
+    struct Tap
+    {
+        int g0, g1, g2;     // position within the bounding box
+        float value;
+    };
+
+    GaussianKernel(int max_size, float sigma, float tolerance) :
+        GaussianKernel({ max_size, max_size, max_size }, { sigma, sigma, sigma }, tolerance)
+    {};
+    GaussianKernel(const std::array<int, 3>& max_size, const std::array<float, 3>& sigma, float tolerance)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            assert(max_size[axis] % 2 == 1);
+
+            const float inv_sigma2 = 1 / (2 * sigma[axis] * sigma[axis]);
+            int radius = 0;
+            while (radius < max_size[axis] / 2 && std::exp(-(radius + 1) * (radius + 1) * inv_sigma2) >= tolerance)
+                ++radius;
+            _dims[axis] = 2 * radius + 1;
+        }
+
+        const Matrix3D dense = GaussianMatrix(_dims[0], _dims[1], _dims[2], sigma[0], sigma[1], sigma[2]);
+        for (int g2 = 0; g2 < _dims[2]; ++g2)
+            for (int g1 = 0; g1 < _dims[1]; ++g1)
+                for (int g0 = 0; g0 < _dims[0]; ++g0)
+                {
+                    const float value = dense.get({ g0, g1, g2 });
+                    if (value >= tolerance)
+                        _taps.push_back({ g0, g1, g2, value });
+                }
+    };
+
+    int dim0()  const                       { return _dims[0]; };
+    int dim1()  const                       { return _dims[1]; };
+    int dim2()  const                       { return _dims[2]; };
+    int size()  const                       { return static_cast<int>(_taps.size()); };
+    const std::vector<Tap>& taps() const    { return _taps; };
+
+private:
+    std::array<int, 3> _dims;
+    std::vector<Tap> _taps;
+};
+
+// Filter of the parameters, can be shared by matrices
+inline std::shared_ptr<const GaussianKernel> make_filter(const Parameters& params)
+{
+    return std::make_shared<const GaussianKernel>(
+        std::array<int, 3>{ params.filter_size, params.filter_size, params.filter_size_along_z() },
+        std::array<float, 3>{ params.sigma, params.sigma, params.sigma_along_z() }, params.kernel_tolerance);
+}
+
+
+inline unsigned int seed(const Parameters& params)
+{
+    std::random_device rd;
+    return params.use_random_device ? rd() : params.seed;
+}
+
+// Counter-based random numbers: number counter of a stream of the seed, from the SplitMix64 finalizer. Numbers of
+// distinct counters and streams are independent, so they can be drawn in any order, e.g. split between threads.
+enum class RandomStream : uint64_t { jitter = 1, initial_bitmap = 2 };
+
+inline uint64_t splitmix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t counter_random(unsigned int seed, RandomStream stream, uint64_t counter)
+{
+    constexpr uint64_t GOLDEN_GAMMA = 0x9E3779B97F4A7C15ull;
+    const uint64_t key = splitmix64(splitmix64(seed) ^ static_cast<uint64_t>(stream));
+    return splitmix64(key + (counter + 1) * GOLDEN_GAMMA);
+}
+
+// Random number to [0, 1)
+inline double unit_interval(uint64_t random)
+{
+    return (random >> 11) * (1.0 / (uint64_t(1) << 53));
+}
+
+// Energy field representations: float (default), double, or int32_t fixed point. Fixed point adds and subtracts
+// exactly, so energies do not depend on the order of the splats. Its scale is a power of two chosen per filter.
+template<class Energy>
+Energy to_energy(double value, double scale)
+{
+    if constexpr (std::is_integral<Energy>::value)
+        return static_cast<Energy>(std::llround(value * scale));
+    else
+        return static_cast<Energy>(value);
+}
+
+// Energies are never larger than the sum of the taps (plus the jitter): leave a bit of headroom below 2^31
+template<class Energy>
+double energy_scale(const GaussianKernel& filter)
+{
+    if constexpr (!std::is_integral<Energy>::value)
+        return 1;
+    double sum = 1;
+    for (const auto& tap : filter.taps())
+        sum += tap.value;
+    return std::exp2(std::floor(std::log2(double(1 << 30) / sum)));
+}
+
+// Initial energy of voxel idx, a jitter far below the taps that breaks the ties of the first placements
+template<class Energy>
+Energy jitter_energy(unsigned int seed, int64_t idx, double scale)
+{
+    float EPS = 1e-7;
+    return to_energy<Energy>(EPS * unit_interval(counter_random(seed, RandomStream::jitter, idx)), scale);
+}
+
+// Discrete Fourier transform of any length, mixed radix Cooley-Tukey over the prime factors of the length.
+// Prime factors are transformed directly, so lengths with large prime factors are slower, O(n * p).
+class FFT
+{
+public:
+    using Complex = std::complex<double>;
+
+    explicit FFT(int n) : _n(n), _twiddles(n), _scratch(n)
+    {
+        const double pi = std::acos(-1.0);
+        for (int k = 0; k < n; ++k)
+            _twiddles[k] = std::polar(1.0, -2 * pi * k / n);
+
+        int p = 2;
+        for (int m = n; m > 1; m /= p)
+        {
+            while (m % p != 0)
+                p = p * p > m ? m : p + 1;
+            _factors.push_back(p);
+        }
+        if (_factors.empty())
+            _factors.push_back(1);
+        _butterfly.resize(*std::max_element(_factors.begin(), _factors.end()));
+    };
+
+    int size() const { return _n; };
+
+    // In place and unnormalized, inverse of forward transform multiplies by size()
+    void transform(Complex* x, bool inverse)
+    {
+        std::copy(x, x + _n, _scratch.begin());
+        transform(x, _scratch.data(), _n, 1, 0, inverse);
+    }
+
+private:
+    // DFT of n values in[0], in[stride], .. into out[0 .. n - 1]
+    void transform(Complex* out, const Complex* in, int n, int stride, int factor, bool inverse)
+    {
+        const int p = _factors[factor];
+        const int m = n / p;
+        if (m == 1)
+            for (int q = 0; q < p; ++q)
+                out[q] = in[q * stride];
+        else
+            for (int q = 0; q < p; ++q)
+                transform(out + q * m, in + q * stride, m, stride * p, factor + 1, inverse);
+
+        // out[k + q2 * m] = sum over q of W_n^(q * (k + q2 * m)) * (DFT q)[k], W_n = W_N^(N / n)
+        const long long step = _n / n;
+        for (int k = 0; k < m; ++k)
+        {
+            for (int q = 0; q < p; ++q)
+                _butterfly[q] = out[q * m + k];
+            for (int q2 = 0; q2 < p; ++q2)
+            {
+                Complex sum = _butterfly[0];
+                for (int q = 1; q < p; ++q)
+                {
+                    const Complex& w = _twiddles[q * (k + q2 * m) * step % _n];
+                    sum += _butterfly[q] * (inverse ? std::conj(w) : w);
+                }
+                out[q2 * m + k] = sum;
+            }
+        }
+    }
+
+    const int _n;
+    std::vector<Complex> _twiddles;
+    std::vector<Complex> _scratch, _butterfly;
+    std::vector<int> _factors;
+};
+
+// DFT along axis of the lines first, first + step, .. of a d0 x d1 x d2 volume, x fastest. Lines along an axis are
+// numbered in raster order of the other two coordinates, there are x.size() / dims[axis] of them.
+inline void transform_lines(std::vector<FFT::Complex>& x, const int dims[3], int axis, bool inverse, int first, int step)
+{
+    const int n = dims[axis];
+    const int64_t stride = axis == 0 ? 1 : axis == 1 ? dims[0] : int64_t(dims[0]) * dims[1];
+    const int64_t lines = static_cast<int64_t>(x.size()) / n;
+    FFT fft(n);
+    std::vector<FFT::Complex> line(n);
+    for (int64_t l = first; l < lines; l += step)
+    {
+        const int64_t start = l % stride + l / stride * stride * n;
+        for (int i = 0; i < n; ++i)
+            line[i] = x[start + i * stride];
+        fft.transform(line.data(), inverse);
+        for (int i = 0; i < n; ++i)
+            x[start + i * stride] = line[i];
+    }
+}
+
+// 3D DFT of a d0 x d1 x d2 volume, x fastest, one axis at a time
+inline void transform_3d(std::vector<FFT::Complex>& x, int d0, int d1, int d2, bool inverse)
+{
+    const int dims[3] = { d0, d1, d2 };
+    for (int axis = 0; axis < 3; ++axis)
+        transform_lines(x, dims, axis, inverse, 0, 1);
+}
+
+// Adds the periodic convolution of the points (indices into energy) with the filter to energy, i.e. the sum of
+// the filter splatted at each point, up to rounding (exact in fixed point). O(n log n) whatever the number of points.
+// Both real inputs go through a single complex transform, the points as real part and the wrapped filter as imaginary.
+// tap_energies are the values of the filter taps as energies.
+template<class Energy>
+void add_periodic_convolution(BasicMatrix3D<Energy>& energy, const std::vector<int64_t>& points, const GaussianKernel& filter,
+    const std::vector<Energy>& tap_energies)
+{
+    const int d0 = energy.dim0(), d1 = energy.dim1(), d2 = energy.dim2();
+    std::vector<FFT::Complex> x(energy.size());
+    for (const int64_t idx : points)
+        x[idx] += 1.0;
+    for (int t = 0; t < filter.size(); ++t)
+    {
+        const auto& tap = filter.taps()[t];
+        int i0 = tap.g0 - filter.dim0() / 2;
+        int i1 = tap.g1 - filter.dim1() / 2;
+        int i2 = tap.g2 - filter.dim2() / 2;
+        mod(i0, d0);
+        mod(i1, d1);
+        mod(i2, d2);
+        x[i0 + (i1 + int64_t(i2) * d1) * d0] += FFT::Complex(0, double(tap_energies[t]));
+    }
+
+    transform_3d(x, d0, d1, d2, false);
+
+    // Spectra of real inputs are hermitian, so with X = P + iK: P[k] = (X[k] + X*[-k]) / 2, K[k] = (X[k] - X*[-k]) / 2i.
+    // Their product is hermitian too, k and -k are done together.
+    for (int k2 = 0; k2 < d2; ++k2)
+    for (int k1 = 0; k1 < d1; ++k1)
+    for (int k0 = 0; k0 < d0; ++k0)
+    {
+        const int64_t idx = k0 + (k1 + int64_t(k2) * d1) * d0;
+        const int64_t neg = (d0 - k0) % d0 + ((d1 - k1) % d1 + int64_t((d2 - k2) % d2) * d1) * d0;
+        if (neg < idx)
+            continue;
+        const FFT::Complex a = x[idx], b = std::conj(x[neg]);
+        const FFT::Complex product = (a + b) * (a - b) / FFT::Complex(0, 4);
+        x[idx] = product;
+        x[neg] = std::conj(product);
+    }
+
+    transform_3d(x, d0, d1, d2, true);
+
+    const double scale = 1.0 / energy.size();
+    for (int64_t idx = 0; idx < energy.size(); ++idx)
+        energy.at(idx) += to_energy<Energy>(x[idx].real() * scale, 1);
+}
+
+// Orderings of the tracked (energy, index) pairs. Index breaks ties, so the order is total
+// and the largest void/cluster is unique whichever tracker backend is used.
+template<class Energy>
+struct VoidOrder    // smallest energy first, ties resolved to smallest index
+{
+    using Key = Energy;
+    static constexpr bool ascending = true;
+    static bool before(Key a, int64_t idx_a, Key b, int64_t idx_b) { return a < b || (a == b && idx_a < idx_b); }
+};
+
+template<class Energy>
+struct ClusterOrder // largest energy first, ties resolved to largest index
+{
+    using Key = Energy;
+    static constexpr bool ascending = false;
+    static bool before(Key a, int64_t idx_a, Key b, int64_t idx_b) { return a > b || (a == b && idx_a > idx_b); }
+};
+
+// Tracker interface: keys are read from an external array (the energy of each voxel), trackers hold indices only.
+// Keys are of type Order::Key.
+//   insert(idx)          start tracking idx
+//   erase(idx)           stop tracking idx, returns false if idx was not tracked
+//   update(idx, old_key) keys[idx] has changed from old_key, no-op if idx is not tracked
+//   assign(first, last)  track exactly the indices in [first, last), built in bulk
+//   contains(idx)        true if idx is tracked
+//   empty()              true if nothing is tracked
+//   top()                tracked index which comes first in Order, only if not empty()
+//   clear()              stop tracking everything
+
+// Reference implementation, red-black tree of (key, index) pairs
+template<class Order>
+class SetTracker
+{
+public:
+    using Key = typename Order::Key;
+
+    SetTracker(const Key* keys, int /*size*/) : _keys(keys) {};
+
+    void insert(int idx)                { _set.insert({ _keys[idx], idx }); };
+    bool erase(int idx)                 { return _set.erase({ _keys[idx], idx }) > 0; };
+    void update(int idx, Key old_key)
+    {
+        if (_set.erase({ old_key, idx }))
+            _set.insert({ _keys[idx], idx });
+    }
+    void clear()                        { _set.clear(); };
+    template<class It>
+    void assign(It first, It last)
+    {
+        _set.clear();
+        for (; first != last; ++first)
+            insert(*first);
+    }
+    bool contains(int idx) const        { return _set.count({ _keys[idx], idx }) > 0; };
+    bool empty() const                  { return _set.empty(); };
+    int  top() const                    { return _set.cbegin()->second; };
+
+private:
+    using Entry = std::pair<Key, int>;
+    struct Compare
+    {
+        bool operator()(const Entry& a, const Entry& b) const { return Order::before(a.first, a.second, b.first, b.second); }
+    };
+
+    const Key* _keys;
+    std::set<Entry, Compare> _set;
+};
+
+// Indexed d-ary heap. The heap grows to the largest number of tracked indices (few for clusters) and keeps its
+// storage, so once that is reached updates do not allocate.
+template<class Order>
+class HeapTracker
+{
+public:
+    using Key = typename Order::Key;
+
+    HeapTracker(const Key* keys, int size) : _keys(keys), _pos(size, NOT_TRACKED) {};
+
+    void insert(int idx)
+    {
+        _heap.push_back(idx);
+        sift_up(static_cast<int>(_heap.size()) - 1, idx);
+    }
+    bool erase(int idx)
+    {
+        const int pos = _pos[idx];
+        if (pos == NOT_TRACKED)
+            return false;
+
+        _pos[idx] = NOT_TRACKED;
+        const int last = _heap.back();
+        _heap.pop_back();
+        if (pos < static_cast<int>(_heap.size()))
+        {
+            if (before(last, idx))
+                sift_up(pos, last);
+            else
+                sift_down(pos, last);
+        }
+        return true;
+    }
+    void update(int idx, Key old_key)
+    {
+        const int pos = _pos[idx];
+        if (pos == NOT_TRACKED)
+            return;
+
+        if (Order::before(_keys[idx], idx, old_key, idx))
+            sift_up(pos, idx);
+        else
+            sift_down(pos, idx);
+    }
+    void clear()
+    {
+        for (const int idx : _heap)
+            _pos[idx] = NOT_TRACKED;
+        _heap.clear();
+    }
+    // Bottom-up heap construction, O(n) instead of O(n log n) for n inserts
+    template<class It>
+    void assign(It first, It last)
+    {
+        clear();
+        for (; first != last; ++first)
+        {
+            _pos[*first] = static_cast<int>(_heap.size());
+            _heap.push_back(*first);
+        }
+        for (int pos = (static_cast<int>(_heap.size()) - 2) / ARITY; pos >= 0 && !_heap.empty(); --pos)
+            sift_down(pos, _heap[pos]);
+    }
+    bool contains(int idx) const        { return _pos[idx] != NOT_TRACKED; };
+    bool empty() const                  { return _heap.empty(); };
+    int  top() const                    { return _heap.front(); };
+
+private:
+    static constexpr int ARITY = 4;
+    static constexpr int NOT_TRACKED = -1;
+
+    bool before(int idx_a, int idx_b) const { return Order::before(_keys[idx_a], idx_a, _keys[idx_b], idx_b); };
+
+    void place(int pos, int idx)
+    {
+        _heap[pos] = idx;
+        _pos[idx] = pos;
+    }
+    // Moves idx from the hole at pos towards the root
+    void sift_up(int pos, int idx)
+    {
+        while (pos > 0)
+        {
+            const int parent = (pos - 1) / ARITY;
+            if (!before(idx, _heap[parent]))
+                break;
+            place(pos, _heap[parent]);
+            pos = parent;
+        }
+        place(pos, idx);
+    }
+    // Moves idx from the hole at pos towards the leaves
+    void sift_down(int pos, int idx)
+    {
+        const int size = static_cast<int>(_heap.size());
+        while (true)
+        {
+            const int first = pos * ARITY + 1;
+            if (first >= size)
+                break;
+            const int last = std::min(first + ARITY, size);
+            int best = first;
+            for (int child = first + 1; child < last; ++child)
+                if (before(_heap[child], _heap[best]))
+                    best = child;
+            if (!before(_heap[best], idx))
+                break;
+            place(pos, _heap[best]);
+            pos = best;
+        }
+        place(pos, idx);
+    }
+
+    const Key* _keys;
+    std::vector<int> _pos;
+    std::vector<int> _heap;
+};
+
+// Smallest (ascending) or largest key among the first count keys which are tracked.
+// Returns +infinity (ascending) or -infinity if none is tracked, the largest or lowest value for integer keys.
+// float and int32_t keys are scanned 8 at a time with AVX2 or NEON.
+template<bool ascending, class Key>
+Key masked_extreme(const Key* keys, const uint8_t* tracked, int count)
+{
+    using limits = std::numeric_limits<Key>;
+    const Key worst = ascending ? (limits::has_infinity ? limits::infinity() : limits::max())
+                                : (limits::has_infinity ? -limits::infinity() : limits::lowest());
+    Key best = worst;
+    int i = 0;
+#if defined(__AVX2__)
+    if constexpr (std::is_same<Key, float>::value)
+    {
+        const __m256 worst8 = _mm256_set1_ps(worst);
+        __m256 best8 = worst8;
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m256i tracked8 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(tracked + i)));
+            const __m256  mask8 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(tracked8, _mm256_setzero_si256()));
+            const __m256  keys8 = _mm256_blendv_ps(worst8, _mm256_loadu_ps(keys + i), mask8);
+            best8 = ascending ? _mm256_min_ps(best8, keys8) : _mm256_max_ps(best8, keys8);
+        }
+        alignas(32) float lanes[8];
+        _mm256_store_ps(lanes, best8);
+        for (const float lane : lanes)
+            best = ascending ? std::min(best, lane) : std::max(best, lane);
+    }
+    else if constexpr (std::is_same<Key, int32_t>::value)
+    {
+        const __m256i worst8 = _mm256_set1_epi32(worst);
+        __m256i best8 = worst8;
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m256i tracked8 = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(tracked + i)));
+            const __m256i mask8 = _mm256_cmpgt_epi32(tracked8, _mm256_setzero_si256());
+            const __m256i keys8 = _mm256_blendv_epi8(worst8, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), mask8);
+            best8 = ascending ? _mm256_min_epi32(best8, keys8) : _mm256_max_epi32(best8, keys8);
+        }
+        alignas(32) int32_t lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), best8);
+        for (const int32_t lane : lanes)
+            best = ascending ? std::min(best, lane) : std::max(best, lane);
+    }
+#elif defined(__ARM_NEON)
+    if constexpr (std::is_same<Key, float>::value)
+    {
+        const float32x4_t worst4 = vdupq_n_f32(worst);
+        float32x4_t best4 = worst4;
+        for (; i + 8 <= count; i += 8)
+        {
+            const uint16x8_t tracked8 = vmovl_u8(vld1_u8(tracked + i));
+            const uint32x4_t mask_lo = vcgtq_u32(vmovl_u16(vget_low_u16(tracked8)), vdupq_n_u32(0));
+            const uint32x4_t mask_hi = vcgtq_u32(vmovl_u16(vget_high_u16(tracked8)), vdupq_n_u32(0));
+            const float32x4_t keys_lo = vbslq_f32(mask_lo, vld1q_f32(keys + i), worst4);
+            const float32x4_t keys_hi = vbslq_f32(mask_hi, vld1q_f32(keys + i + 4), worst4);
+            best4 = ascending ? vminq_f32(best4, vminq_f32(keys_lo, keys_hi)) : vmaxq_f32(best4, vmaxq_f32(keys_lo, keys_hi));
+        }
+        best = ascending ? vminvq_f32(best4) : vmaxvq_f32(best4);
+    }
+    else if constexpr (std::is_same<Key, int32_t>::value)
+    {
+        const int32x4_t worst4 = vdupq_n_s32(worst);
+        int32x4_t best4 = worst4;
+        for (; i + 8 <= count; i += 8)
+        {
+            const uint16x8_t tracked8 = vmovl_u8(vld1_u8(tracked + i));
+            const uint32x4_t mask_lo = vcgtq_u32(vmovl_u16(vget_low_u16(tracked8)), vdupq_n_u32(0));
+            const uint32x4_t mask_hi = vcgtq_u32(vmovl_u16(vget_high_u16(tracked8)), vdupq_n_u32(0));
+            const int32x4_t keys_lo = vbslq_s32(mask_lo, vld1q_s32(keys + i), worst4);
+            const int32x4_t keys_hi = vbslq_s32(mask_hi, vld1q_s32(keys + i + 4), worst4);
+            best4 = ascending ? vminq_s32(best4, vminq_s32(keys_lo, keys_hi)) : vmaxq_s32(best4, vmaxq_s32(keys_lo, keys_hi));
+        }
+        best = ascending ? vminvq_s32(best4) : vmaxvq_s32(best4);
+    }
+#endif
+    for (; i < count; ++i)
+        if (tracked[i] && (ascending ? keys[i] < best : keys[i] > best))
+            best = keys[i];
+    return best;
+}
+
+// Index space is split into blocks, each caching its first index in Order.
+// Updates only invalidate the cache of a block if they can change its first index,
+// top() rescans invalidated blocks and reduces over all of them.
+template<class Order>
+class LazyTracker
+{
+public:
+    using Key = typename Order::Key;
+
+    LazyTracker(const Key* keys, int size) :
+        _keys(keys),
+        _size(size),
+        _tracked(size, 0),
+        _blocks((size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+    {};
+
+    void insert(int idx)
+    {
+        _tracked[idx] = 1;
+        ++_count;
+        Block& b = block_of(idx);
+        if (!b.dirty && (b.first == NOT_TRACKED || before(idx, b.first)))
+            b.first = idx;
+    }
+    bool erase(int idx)
+    {
+        if (!_tracked[idx])
+            return false;
+
+        _tracked[idx] = 0;
+        --_count;
+        Block& b = block_of(idx);
+        if (b.first == idx)
+            b.dirty = true;
+        return true;
+    }
+    void update(int idx, Key old_key)
+    {
+        if (!_tracked[idx])
+            return;
+
+        Block& b = block_of(idx);
+        if (b.dirty)
+            return;
+        if (b.first != idx)
+        {
+            if (before(idx, b.first))
+                b.first = idx;
+        }
+        else if (!Order::before(_keys[idx], idx, old_key, idx))
+            b.dirty = true;
+    }
+    void clear()
+    {
+        std::fill(_tracked.begin(), _tracked.end(), 0);
+        std::fill(_blocks.begin(), _blocks.end(), Block{});
+        _count = 0;
+    }
+    template<class It>
+    void assign(It first, It last)
+    {
+        clear();
+        for (; first != last; ++first, ++_count)
+            _tracked[*first] = 1;
+        for (Block& b : _blocks)
+            b.dirty = true;
+    }
+    bool contains(int idx) const        { return _tracked[idx] != 0; };
+    bool empty() const                  { return _count == 0; };
+    int  top() const
+    {
+        int first = NOT_TRACKED;
+        for (int k = 0; k < static_cast<int>(_blocks.size()); ++k)
+        {
+            Block& b = _blocks[k];
+            if (b.dirty)
+                rescan(k);
+            if (b.first != NOT_TRACKED && (first == NOT_TRACKED || before(b.first, first)))
+                first = b.first;
+        }
+        return first;
+    }
+
+private:
+    static constexpr int BLOCK_SIZE = 1024;
+    static constexpr int NOT_TRACKED = -1;
+
+    struct Block
+    {
+        int  first{ NOT_TRACKED };
+        bool dirty{ false };
+    };
+
+    bool   before(int idx_a, int idx_b) const { return Order::before(_keys[idx_a], idx_a, _keys[idx_b], idx_b); };
+    Block& block_of(int idx)                  { return _blocks[idx / BLOCK_SIZE]; };
+
+    void rescan(int k) const
+    {
+        const int begin = k * BLOCK_SIZE;
+        const int count = std::min(BLOCK_SIZE, _size - begin);
+        const Key*     keys    = _keys + begin;
+        const uint8_t* tracked = _tracked.data() + begin;
+        const Key extreme = masked_extreme<Order::ascending>(keys, tracked, count);
+
+        // Ties resolve to smallest index when ascending, to largest otherwise
+        Block& b = _blocks[k];
+        b.first = NOT_TRACKED;
+        b.dirty = false;
+        if (Order::ascending)
+        {
+            for (int i = 0; i < count; ++i)
+                if (tracked[i] && keys[i] == extreme) { b.first = begin + i; break; }
+        }
+        else
+        {
+            for (int i = count - 1; i >= 0; --i)
+                if (tracked[i] && keys[i] == extreme) { b.first = begin + i; break; }
+        }
+    }
+
+    const Key* _keys;
+    const int _size;
+    std::vector<uint8_t> _tracked;
+    int _count{ 0 };
+    mutable std::vector<Block> _blocks;
+};
+
+// Persistent workers. run(task) calls task(worker) for every worker = 0..size()-1 and returns when all are done.
+// Worker 0 is the calling thread. Idle workers spin briefly, then sleep until the next run().
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads)
+    {
+        for (int worker = 1; worker < threads; ++worker)
+            _threads.emplace_back([this, worker] { worker_loop(worker); });
+    };
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (auto& thread : _threads)
+            thread.join();
+    };
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(_threads.size()) + 1; };
+
+    template<class Task>
+    void run(const Task& task)
+    {
+        if (_threads.empty())
+        {
+            task(0);
+            return;
+        }
+
+        _task = &task;
+        _invoke = [](const void* t, int worker) { (*static_cast<const Task*>(t))(worker); };
+        _pending.store(static_cast<int>(_threads.size()), std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _generation.fetch_add(1, std::memory_order_release);
+        }
+        _wake.notify_all();
+
+        task(0);
+        while (_pending.load(std::memory_order_acquire) > 0)
+            std::this_thread::yield();
+    }
+
+private:
+    static constexpr int SPIN_COUNT = 4096;
+
+    void worker_loop(int worker)
+    {
+        unsigned long long seen = 0;
+        while (true)
+        {
+            for (int spin = 0; spin < SPIN_COUNT && _generation.load(std::memory_order_acquire) == seen; ++spin)
+                std::this_thread::yield();
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [&] { return _stop || _generation.load(std::memory_order_acquire) != seen; });
+                if (_stop)
+                    return;
+            }
+            seen = _generation.load(std::memory_order_acquire);
+            _invoke(_task, worker);
+            _pending.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stop{ false };
+    std::atomic<unsigned long long> _generation{ 0 };
+    std::atomic<int> _pending{ 0 };
+    const void* _task{ nullptr };
+    void (*_invoke)(const void*, int) { nullptr };
+};
+
+// Draws the count indices of [0, size) of smallest random number counter_random(seed, initial_bitmap, index), into
+// candidates in increasing order of index. Threads of pool draw the numbers of a part of the indices each, into kept
+// (one per thread), and keep only those below a threshold, about twice count of them, which is doubled in the
+// unlikely case of fewer than count. The indices do not depend on the number of threads.
+using RandomCandidate = std::pair<uint64_t, int64_t>;   // random number, index
+inline void draw_random_candidates(int64_t size, int count, unsigned int seed, ThreadPool& pool,
+                                   std::vector<std::vector<RandomCandidate>>& kept, std::vector<RandomCandidate>& candidates)
+{
+    for (double fraction = 2.0 * count / size; ; fraction *= 2)
+    {
+        const uint64_t threshold = fraction >= 1 ? std::numeric_limits<uint64_t>::max() : uint64_t(std::ldexp(fraction, 64));
+        pool.run([&](int worker)
+        {
+            auto& worker_kept = kept[worker];
+            worker_kept.clear();
+            const int64_t end = size * (worker + 1) / pool.size();
+            for (int64_t idx = size * worker / pool.size(); idx < end; ++idx)
+            {
+                const uint64_t random = counter_random(seed, RandomStream::initial_bitmap, idx);
+                if (random <= threshold)
+                    worker_kept.emplace_back(random, idx);
+            }
+        });
+        candidates.clear();
+        for (const auto& worker_kept : kept)
+            candidates.insert(candidates.end(), worker_kept.begin(), worker_kept.end());
+        if (candidates.size() >= size_t(count) || fraction >= 1)
+            break;
+    }
+    std::nth_element(candidates.begin(), candidates.begin() + count, candidates.end());
+    candidates.resize(count);
+    std::sort(candidates.begin(), candidates.end(), [](const RandomCandidate& a, const RandomCandidate& b) { return a.second < b.second; });
+}
+
+// Where a voxel is tracked, in the state of a generation (save_state, checkpoints). Voids are the unoccupied voxels.
+enum Tracking : uint8_t { TRACKED_AS_VOID = 0, TRACKED_AS_CLUSTER = 1, UNTRACKED = 2 };
+
+// Work done by a matrix with tracking, for benchmarks
+struct Statistics
+{
+    uint64_t placements = 0;            // voxels set
+    uint64_t splats = 0;                // filters added or removed
+    uint64_t taps = 0;                  // energies updated by the splats
+    uint64_t tracker_operations = 0;    // inserts, erases, updates and top reads of plane trackers
+};
+
+// The matrix holds the ranks. Occupancy is kept apart, as a bitset, since ranks don't tell it (rank 0, or pixels
+// of the initial pattern, which are ranked only later). Energies are of type Energy: float, double or int32_t
+// fixed point (see to_energy).
+template<template<class> class TrackerT = HeapTracker, class Energy = float>
+class Matrix3D_w_void_and_cluster_tracking : public RankMatrix3D
+{
+public:
+    using energy_type = Energy;
+
+    explicit Matrix3D_w_void_and_cluster_tracking(const Parameters& params) :
+        Matrix3D_w_void_and_cluster_tracking(params, make_filter(params))
+    {};
+    // Filter can be shared between matrices, e.g. for batch generation
+    Matrix3D_w_void_and_cluster_tracking(const Parameters& params, std::shared_ptr<const GaussianKernel> shared_filter): 
+        RankMatrix3D(params.d0, params.d1, params.d2, params.ranks_file),
+        weights(params.d0, params.d1, params.d2, params.energies_file),
+        _occupied(params.size()),
+        _filter(std::move(shared_filter)),
+        filter(*_filter),
+        _plane_size(params.d0 * params.d1),
+        _pool(params.threads),
+        _fft_initialization(params.fft_initialization)
+    {
+        tracking_initialization();
+        splat_initialization();
+        reset(seed(params));
+    };
+    // Trackers refer to the weights, copies would alias them
+    Matrix3D_w_void_and_cluster_tracking(const Matrix3D_w_void_and_cluster_tracking&) = delete;
+    Matrix3D_w_void_and_cluster_tracking& operator=(const Matrix3D_w_void_and_cluster_tracking&) = delete;
+
+    // Back to the state before phase 1, with new random jitter. Does not allocate.
+    void reset(unsigned int seed)
+    {
+        fill(0);
+        _occupied.clear();
+        small_randomization(seed);
+        _cluster_tracking_is_on = true;
+        build_tracking([](int64_t) { return TRACKED_AS_VOID; });
+        _progress->reset();
+    }
+
+    bool occupied(const T3& t3) const { return _occupied.test(T3_to_idx(t3)); };
+
+    void set_pixel(const T3& t3, uint32_t rank)
+    {
+        const int64_t idx = T3_to_idx(t3);
+        if (_occupied.test(idx))
+            throw std::runtime_error("already set");
+
+        at(idx) = rank;
+        _occupied.set(idx);
+        ++_statistics.placements;
+        add_to_cluster(t3);
+        conv_at(t3);
+    }
+    // Same as set_pixel(t3, 0) for each of the points, on a matrix just reset(). Trackers are built once at the end.
+    // Energies are splatted point by point without tracking, giving the very same energies as set_pixel(),
+    // or computed in one pass by FFT convolution if fft_convolution or fft_initialization is set.
+    void set_pixels(const std::vector<T3>& points, bool fft_convolution = false)
+    {
+        for (auto& track_cluster : _track_cluster)
+            track_cluster.clear();
+        for (auto& track_void : _track_void)
+            track_void.clear();
+
+        _indices.clear();
+        for (const T3& t3 : points)
+        {
+            const int64_t idx = T3_to_idx(t3);
+            if (_occupied.test(idx))
+                throw std::runtime_error("already set");
+            _occupied.set(idx);
+            _indices.push_back(idx);
+        }
+        _statistics.placements += points.size();
+
+        // Updates of untracked voxels are no-ops
+        if (fft_convolution || _fft_initialization)
+            add_periodic_convolution(weights, _indices, filter, _tap_energies);
+        else
+            for (const T3& t3 : points)
+                conv_at(t3);
+
+        build_tracking([&](int64_t idx) { return _occupied.test(idx) ? TRACKED_AS_CLUSTER : TRACKED_AS_VOID; });
+    }
+    // Same as set_pixels() of count distinct random points: the count voxels of smallest counter_random(seed,
+    // initial_bitmap, index), drawn by the threads (draw_random_candidates). Points are set in raster order, so
+    // energies do not depend on the number of threads.
+    void set_random_pixels(int count, unsigned int seed)
+    {
+        draw_random_candidates(size(), count, seed, _pool, _kept_candidates, _candidates);
+        _points.clear();
+        for (const RandomCandidate& candidate : _candidates)
+            _points.push_back(idx_to_T3(candidate.second));
+        set_pixels(_points);
+    }
+    void reset_pixel(const T3& t3)
+    {
+        const int64_t idx = T3_to_idx(t3);
+        at(idx) = 0;
+        _occupied.reset(idx);
+        add_to_void(t3);
+        deconv_at(t3);
+    }
+
+    void remove_tracking(const T3& t3)
+    {
+        const int64_t idx = T3_to_idx(t3);
+        _track_void[plane_of(idx)].erase(in_plane(idx));
+        _track_cluster[plane_of(idx)].erase(in_plane(idx));
+        changed(plane_of(idx));
+        _statistics.tracker_operations += 2;
+    }
+    void cluster_tracking_off()
+    {
+        if (!_cluster_tracking_is_on)
+            return;
+        _cluster_tracking_is_on = false;
+        for (auto& track_cluster : _track_cluster)
+            track_cluster.clear();
+        std::fill(_cluster_tops.begin(), _cluster_tops.end(), PlaneTop{});
+    }
+
+    const T3   max_void()    const { return idx_to_T3(first_of<Void>(_track_void, _void_tops, 0, dim2())); };
+    Energy     energy(const T3& t3) const { return weights.get(t3); };
+    const T3   max_cluster() const { return idx_to_T3(first_of<Cluster>(_track_cluster, _cluster_tops, 0, dim2())); };
+
+    // Slabs of a tiled generation: slab s of slabs is planes [s * dim2() / slabs, (s + 1) * dim2() / slabs).
+    // Splats of slabs of the same parity land on distinct planes if slabs are even in number and each is as thick as
+    // the filter along z minus one: their energies spill over into the neighbouring slabs only, of the other parity.
+    bool can_tile(int slabs) const
+    {
+        return slabs >= 2 && slabs % 2 == 0 && dim2() / slabs >= filter.dim2() - 1;
+    }
+    // Sets the largest void of each slab to the ranks rank, rank + 1, .., slabs of even index first and then odd ones,
+    // and splats each half concurrently. Full slabs are skipped. Returns the number of voxels set. Textures are the same
+    // whatever the number of threads: voids are found by the calling thread, and each plane is updated by one splat.
+    int set_largest_voids_of_slabs(int slabs, int64_t rank)
+    {
+        if (!can_tile(slabs))
+            throw std::invalid_argument("slabs must be even in number and as thick as the filter along z minus one");
+
+        int count = 0;
+        for (int parity = 0; parity < 2; ++parity)
+        {
+            _concurrent_voids.clear();
+            for (int slab = parity; slab < slabs; slab += 2)
+            {
+                const int64_t idx = first_of<Void>(_track_void, _void_tops, int(int64_t(slab) * dim2() / slabs), int(int64_t(slab + 1) * dim2() / slabs));
+                if (idx >= 0)
+                    _concurrent_voids.push_back(idx_to_T3(idx));
+            }
+            set_concurrent_voids(rank + count);
+            count += static_cast<int>(_concurrent_voids.size());
+        }
+        return count;
+    }
+    // Sets up to batch of the largest voids to the ranks rank, rank + 1, .. and splats them concurrently. Candidates
+    // are the largest void of each plane, in order, each taken if its plane is at least filter.dim2() from those of the
+    // voids taken before on the torus: then no two splats share a plane. The first is max_void(), the others are not
+    // always what placing one by one would give. Returns the number of voxels set, at least one unless all are.
+    // Textures are the same whatever the number of threads.
+    int set_largest_voids_apart(int batch, int64_t rank)
+    {
+        _batch_candidates.clear();
+        for (int plane = 0; plane < dim2(); ++plane)
+        {
+            const int64_t idx = first_of<Void>(_track_void, _void_tops, plane, plane + 1);
+            if (idx >= 0)
+                _batch_candidates.push_back(idx);
+        }
+        std::sort(_batch_candidates.begin(), _batch_candidates.end(), [&](int64_t a, int64_t b)
+        {
+            return Void::before(weights.get(a), a, weights.get(b), b);
+        });
+
+        _concurrent_voids.clear();
+        for (const int64_t idx : _batch_candidates)
+        {
+            if (static_cast<int>(_concurrent_voids.size()) == batch)
+                break;
+            const int plane = plane_of(idx);
+            const bool apart = std::all_of(_concurrent_voids.cbegin(), _concurrent_voids.cend(), [&](const T3& t3)
+            {
+                const int distance = std::abs(std::get<2>(t3) - plane);
+                return std::min(distance, dim2() - distance) >= filter.dim2();
+            });
+            if (apart)
+                _concurrent_voids.push_back(idx_to_T3(idx));
+        }
+        set_concurrent_voids(rank);
+        return static_cast<int>(_concurrent_voids.size());
+    }
+
+    // Since construction or the last reset_statistics()
+    const Statistics& statistics() const { return _statistics; };
+
+
+    // Updated by the phase functions. Other matrices can report to this one's progress instead of their own,
+    // e.g. coarse levels of a generation.
+    Progress& progress() const { return *_progress; };
+    void report_progress_to(Progress& progress) { _progress = &progress; };
+    void reset_statistics() { _statistics = Statistics(); };
+
+    // Whole state of the generation, for checkpoints: the matrix itself (ranks), energies and tracking of each voxel.
+    // Arrays have size() elements.
+    bool cluster_tracking_is_on() const { return _cluster_tracking_is_on; };
+    void save_state(uint32_t* ranks, Energy* energies, uint8_t* tracking) const
+    {
+        std::copy(data(), data() + size(), ranks);
+        std::copy(weights.data(), weights.data() + size(), energies);
+        for (int64_t idx = 0; idx < size(); ++idx)
+            tracking[idx] = _track_void[plane_of(idx)].contains(in_plane(idx))    ? TRACKED_AS_VOID :
+                            _track_cluster[plane_of(idx)].contains(in_plane(idx)) ? TRACKED_AS_CLUSTER : UNTRACKED;
+    }
+    // Energies have to match the ranks, as saved by save_state(). Does not allocate.
+    void load_state(const uint32_t* ranks, const Energy* energies, const uint8_t* tracking, bool cluster_tracking_on)
+    {
+        std::copy(ranks, ranks + size(), data());
+        std::copy(energies, energies + size(), weights.data());
+        for (int64_t idx = 0; idx < size(); ++idx)
+        {
+            if (tracking[idx] == TRACKED_AS_VOID)
+                _occupied.reset(idx);
+            else
+                _occupied.set(idx);
+        }
+        _cluster_tracking_is_on = cluster_tracking_on;
+        build_tracking([&](int64_t idx) { return static_cast<Tracking>(tracking[idx]); });
+    }
+    // Ranks of the voxels set so far, the others get unset_rank, e.g. for a preview of the generation (RankStream)
+    void save_ranks(uint32_t* ranks, uint32_t unset_rank) const
+    {
+        for (int64_t idx = 0; idx < size(); ++idx)
+            ranks[idx] = _occupied.test(idx) ? get(idx) : unset_rank;
+    }
+
+
+protected:
+    using Void    = VoidOrder<Energy>;
+    using Cluster = ClusterOrder<Energy>;
+
+    BasicMatrix3D<Energy> weights;
+    Bitset _occupied;
+
+    const std::shared_ptr<const GaussianKernel> _filter;
+    const GaussianKernel& filter;
+
+    // Tracking is split by z-plane: each plane has its own trackers, indexed within the plane.
+    // Taps of one filter layer land on one plane, so layers can be splatted concurrently.
+    const int _plane_size;
+    std::vector<TrackerT<Void>>    _track_void;
+    std::vector<TrackerT<Cluster>> _track_cluster;
+    // Scratch of build_tracking(), indices of one plane
+    std::vector<int> _plane_voids, _plane_clusters;
+    // max_void() and max_cluster() reduce over the top of each plane, cached with its energy. Splats and tracking
+    // changes mark the planes they touch as stale, so a placement rescans about filter.dim2() planes, not dim2().
+    struct PlaneTop
+    {
+        int    idx{ STALE };
+        Energy key{};
+    };
+    static constexpr int STALE = -2, EMPTY = -1;
+    mutable std::vector<PlaneTop> _void_tops, _cluster_tops;
+
+    ThreadPool _pool;
+    const bool _fft_initialization;
+    mutable Statistics _statistics;
+    Progress _own_progress;
+    Progress* _progress{ &_own_progress };
+
+    // Filter taps are sorted by layer, taps of layer g2 are [_layer_begin[g2], _layer_begin[g2 + 1])
+    std::vector<int> _layer_begin;
+    // Values of the filter taps as energies, and the fixed point scale
+    std::vector<Energy> _tap_energies;
+    double _energy_scale{ 1 };
+    // Filter taps as offsets from the filter center within the plane, valid away from the boundary
+    std::vector<int> _filter_offsets;
+    // Wrapped coordinates per filter axis, rebuilt by each boundary splat. i1 is multiplied by dim0().
+    // One per thread, for the concurrent splats of set_largest_voids_of_slabs().
+    struct Wraps
+    {
+        std::vector<int> i0, i1, i2;
+    };
+    std::vector<Wraps> _wraps;
+    // Scratch of set_largest_voids_of_slabs() and set_largest_voids_apart()
+    std::vector<T3> _concurrent_voids;
+    std::vector<int64_t> _batch_candidates;
+    // Scratch of set_random_pixels() and set_pixels(), kept so that later generations allocate nothing
+    std::vector<std::vector<RandomCandidate>> _kept_candidates;
+    std::vector<RandomCandidate> _candidates;
+    std::vector<T3> _points;
+    std::vector<int64_t> _indices;
+
+    // Splat of one filter layer away from the boundary, specialized at startup for dense filters of common sizes
+    using InteriorLayerSplat = void (Matrix3D_w_void_and_cluster_tracking::*)(int g2, int plane, int center, Energy sign);
+    InteriorLayerSplat _splat_interior_layer{ nullptr };
+
+    int plane_of(int64_t idx) const { return static_cast<int>(idx / _plane_size); };
+    int in_plane(int64_t idx) const { return static_cast<int>(idx % _plane_size); };
+
+    template<class Order, class Trackers>
+    int64_t first_of(const Trackers& trackers, std::vector<PlaneTop>& tops, int begin_plane, int end_plane) const
+    {
+        int64_t first = -1;
+        Energy first_key{};
+        for (int plane = begin_plane; plane < end_plane; ++plane)
+        {
+            PlaneTop& top = tops[plane];
+            if (top.idx == STALE)
+            {
+                top.idx = trackers[plane].empty() ? EMPTY : trackers[plane].top();
+                if (top.idx != EMPTY)
+                    top.key = weights.get(int64_t(plane) * _plane_size + top.idx);
+                ++_statistics.tracker_operations;
+            }
+            if (top.idx == EMPTY)
+                continue;
+            const int64_t idx = int64_t(plane) * _plane_size + top.idx;
+            if (first < 0 || Order::before(top.key, idx, first_key, first))
+            {
+                first = idx;
+                first_key = top.key;
+            }
+        }
+        return first;
+    }
+    // Sets the voids of _concurrent_voids to the ranks rank, rank + 1, .. and splats them concurrently, one splat per
+    // worker at a time. Their splats must not share a plane.
+    void set_concurrent_voids(int64_t rank)
+    {
+        int64_t next = rank;
+        for (const T3& t3 : _concurrent_voids)
+        {
+            const int64_t idx = T3_to_idx(t3);
+            at(idx) = static_cast<uint32_t>(next++);
+            _occupied.set(idx);
+            add_to_cluster(t3);
+        }
+
+        const uint64_t voids = _concurrent_voids.size();
+        _statistics.placements += voids;
+        _statistics.splats += voids;
+        _statistics.taps += voids * filter.size();
+        _statistics.tracker_operations += voids * filter.size();
+        _pool.run([&](int worker)
+        {
+            for (size_t i = worker; i < _concurrent_voids.size(); i += _pool.size())
+                splat_layers(_concurrent_voids[i], Energy(1), _wraps[worker], false);
+        });
+    }
+    // Trackers or energies of plane have changed. Splats of distinct planes can call it concurrently.
+    void changed(int plane)
+    {
+        _void_tops[plane].idx = STALE;
+        _cluster_tops[plane].idx = STALE;
+    }
+
+    void add_to_void(const T3& t3)
+    {
+        const int64_t idx = T3_to_idx(t3);
+        _track_cluster[plane_of(idx)].erase(in_plane(idx));
+        _track_void[plane_of(idx)].insert(in_plane(idx));
+        changed(plane_of(idx));
+        _statistics.tracker_operations += 2;
+    }
+    void add_to_cluster(const T3& t3)
+    {
+
+        const int64_t idx = T3_to_idx(t3);
+        auto was_tracked = _track_void[plane_of(idx)].erase(in_plane(idx));
+        if (was_tracked && _cluster_tracking_is_on)
+            _track_cluster[plane_of(idx)].insert(in_plane(idx));
+        changed(plane_of(idx));
+        _statistics.tracker_operations += was_tracked && _cluster_tracking_is_on ? 2 : 1;
+    }
+
+    void conv_at(const T3& r)   { splat(r, Energy(1)); };
+    void deconv_at(const T3& r) { splat(r, Energy(-1)); };
+
+    // Adds sign * filter centered at r. Within a layer, taps are visited in the filter's order.
+    void splat(const T3& r, Energy sign)
+    {
+        // Each tap updates the tracker of its voxel
+        ++_statistics.splats;
+        _statistics.taps += filter.size();
+        _statistics.tracker_operations += filter.size();
+
+        // Layers must land on distinct planes to be splatted concurrently
+        splat_layers(r, sign, _wraps[0], _pool.size() > 1 && filter.dim2() <= dim2());
+    }
+    // Same without statistics, layers by the pool's threads if concurrent_layers, else by the calling thread
+    void splat_layers(const T3& r, Energy sign, Wraps& wraps, bool concurrent_layers)
+    {
+        const int c0 = filter.dim0() / 2;
+        const int c1 = filter.dim1() / 2;
+        const int c2 = filter.dim2() / 2;
+        const int r0 = std::get<0>(r);
+        const int r1 = std::get<1>(r);
+        const int r2 = std::get<2>(r);
+
+        // Interior: filter does not cross the torus boundary, no wrapping needed
+        const bool interior =
+            r0 >= c0 && r0 - c0 + filter.dim0() <= dim0() &&
+            r1 >= c1 && r1 - c1 + filter.dim1() <= dim1() &&
+            r2 >= c2 && r2 - c2 + filter.dim2() <= dim2();
+
+        // Boundary: wrap once per filter row/column/layer instead of once per tap
+        if (!interior)
+        {
+            for (int g0 = 0; g0 < filter.dim0(); ++g0)
+            {
+                int i0 = r0 - c0 + g0;
+                mod(i0, dim0());
+                wraps.i0[g0] = i0;
+            }
+            for (int g1 = 0; g1 < filter.dim1(); ++g1)
+            {
+                int i1 = r1 - c1 + g1;
+                mod(i1, dim1());
+                wraps.i1[g1] = i1 * dim0();
+            }
+            for (int g2 = 0; g2 < filter.dim2(); ++g2)
+            {
+                int i2 = r2 - c2 + g2;
+                mod(i2, dim2());
+                wraps.i2[g2] = i2;
+            }
+        }
+
+        const int center = r0 + r1 * dim0();
+        const int first_plane = r2 - c2;
+        auto splat_layers_of = [&](int worker)
+        {
+            for (int g2 = worker; g2 < filter.dim2(); g2 += _pool.size())
+                splat_layer(g2, interior ? first_plane + g2 : wraps.i2[g2], interior, center, sign, wraps);
+        };
+
+        if (concurrent_layers)
+            _pool.run(splat_layers_of);
+        else
+            for (int g2 = 0; g2 < filter.dim2(); ++g2)
+                splat_layer(g2, interior ? first_plane + g2 : wraps.i2[g2], interior, center, sign, wraps);
+    }
+    void splat_layer(int g2, int plane, bool interior, int center, Energy sign, const Wraps& wraps)
+    {
+        if (interior)
+            (this->*_splat_interior_layer)(g2, plane, center, sign);
+        else
+            splat_boundary_layer(g2, plane, sign, wraps);
+    }
+
+    // Weights, occupancy and trackers of one plane
+    struct Plane
+    {
+        TrackerT<Void>&         track_void;
+        TrackerT<Cluster>&      track_cluster;
+        Energy*                 weights;
+        const Bitset&           occupied;
+        const int64_t           first;      // index of the plane's first voxel in occupied
+
+        void update(int idx, Energy value)
+        {
+            const Energy old_key = weights[idx];
+            weights[idx] += value;
+            if (occupied.test(first + idx))
+                track_cluster.update(idx, old_key);
+            else
+                track_void.update(idx, old_key);
+        }
+    };
+    Plane plane_at(int plane)
+    {
+        changed(plane);
+        const int64_t first = int64_t(plane) * _plane_size;
+        return { _track_void[plane], _track_cluster[plane], weights.data() + first, _occupied, first };
+    }
+
+    void splat_interior_layer(int g2, int plane, int center, Energy sign)
+    {
+        Plane p = plane_at(plane);
+        for (int t = _layer_begin[g2]; t < _layer_begin[g2 + 1]; ++t)
+            p.update(center + _filter_offsets[t], sign * _tap_energies[t]);
+    }
+    // Dense layer of K x K taps, rows contiguous in the plane. Rows are D0 apart, or dim0() apart if D0 is 0.
+    template<int K, int D0>
+    void splat_interior_layer_dense(int g2, int plane, int center, Energy sign)
+    {
+        Plane p = plane_at(plane);
+        const Energy* tap = _tap_energies.data() + _layer_begin[g2];
+        const int stride = D0 > 0 ? D0 : dim0();
+        const int first_row = center - K / 2 - (K / 2) * stride;
+        for (int g1 = 0; g1 < K; ++g1)
+        {
+            const int row = first_row + g1 * stride;
+            for (int g0 = 0; g0 < K; ++g0)
+                p.update(row + g0, sign * tap[g1 * K + g0]);
+        }
+    }
+    // Instances of the dense splat for the common widths of textures, others read dim0()
+    template<int K>
+    InteriorLayerSplat dense_layer_splat() const
+    {
+        switch (dim0())
+        {
+        case  16: return &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<K, 16>;
+        case  32: return &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<K, 32>;
+        case  64: return &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<K, 64>;
+        case 128: return &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<K, 128>;
+        default:  return &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<K, 0>;
+        }
+    }
+    void splat_boundary_layer(int g2, int plane, Energy sign, const Wraps& wraps)
+    {
+        Plane p = plane_at(plane);
+        const auto& taps = filter.taps();
+        for (int t = _layer_begin[g2]; t < _layer_begin[g2 + 1]; ++t)
+            p.update(wraps.i0[taps[t].g0] + wraps.i1[taps[t].g1], sign * _tap_energies[t]);
+    }
+
+
+    bool _cluster_tracking_is_on{ true };
+
+
+    // Jitter of each voxel from its index, so planes are filled concurrently and give the same energies whatever the threads
+    void small_randomization(unsigned int seed)
+    {
+        _pool.run([&](int worker)
+        {
+            for (int plane = worker; plane < dim2(); plane += _pool.size())
+            {
+                const int64_t first = int64_t(plane) * _plane_size;
+                Energy* plane_weights = weights.data() + first;
+                for (int i = 0; i < _plane_size; ++i)
+                    plane_weights[i] = jitter_energy<Energy>(seed, first + i, _energy_scale);
+            }
+        });
+    }
+
+    void tracking_initialization()
+    {
+        _track_void.reserve(dim2());
+        _track_cluster.reserve(dim2());
+        for (int i2 = 0; i2 < dim2(); ++i2)
+        {
+            _track_void.emplace_back(weights.data() + int64_t(i2) * _plane_size, _plane_size);
+            _track_cluster.emplace_back(weights.data() + int64_t(i2) * _plane_size, _plane_size);
+        }
+        _plane_voids.reserve(_plane_size);
+        _plane_clusters.reserve(_plane_size);
+        _void_tops.resize(dim2());
+        _cluster_tops.resize(dim2());
+        _kept_candidates.resize(_pool.size());
+    }
+
+    // Rebuilds the trackers in bulk, tracking_of(idx) tells where voxel idx belongs
+    template<class TrackingOf>
+    void build_tracking(const TrackingOf& tracking_of)
+    {
+        for (int plane = 0; plane < dim2(); ++plane)
+        {
+            _plane_voids.clear();
+            _plane_clusters.clear();
+            for (int i = 0; i < _plane_size; ++i)
+            {
+                const Tracking tracking = tracking_of(int64_t(plane) * _plane_size + i);
+                if (tracking == TRACKED_AS_VOID)
+                    _plane_voids.push_back(i);
+                else if (tracking == TRACKED_AS_CLUSTER && _cluster_tracking_is_on)
+                    _plane_clusters.push_back(i);
+            }
+            _track_void[plane].assign(_plane_voids.cbegin(), _plane_voids.cend());
+            _track_cluster[plane].assign(_plane_clusters.cbegin(), _plane_clusters.cend());
+            changed(plane);
+            _statistics.tracker_operations += _plane_voids.size() + _plane_clusters.size();
+        }
+    }
+
+    void splat_initialization()
+    {
+        const int c0 = filter.dim0() / 2;
+        const int c1 = filter.dim1() / 2;
+
+        _energy_scale = energy_scale<Energy>(filter);
+        _layer_begin.assign(filter.dim2() + 1, 0);
+        _filter_offsets.reserve(filter.size());
+        _tap_energies.reserve(filter.size());
+        for (const auto& tap : filter.taps())
+        {
+            ++_layer_begin[tap.g2 + 1];
+            _filter_offsets.push_back((tap.g0 - c0) + (tap.g1 - c1) * dim0());
+            _tap_energies.push_back(to_energy<Energy>(tap.value, _energy_scale));
+        }
+        std::partial_sum(_layer_begin.begin(), _layer_begin.end(), _layer_begin.begin());
+
+        _wraps.resize(_pool.size());
+        for (Wraps& wraps : _wraps)
+        {
+            wraps.i0.resize(filter.dim0());
+            wraps.i1.resize(filter.dim1());
+            wraps.i2.resize(filter.dim2());
+        }
+        _concurrent_voids.reserve(dim2());
+        _batch_candidates.reserve(dim2());
+
+        _splat_interior_layer = &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer;
+        const bool dense = filter.size() == filter.dim0() * filter.dim1() * filter.dim2() && filter.dim0() == filter.dim1();
+        if (dense)
+        {
+            switch (filter.dim0())
+            {
+            case  5: _splat_interior_layer = &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<5, 0>;  break;
+            case  7: _splat_interior_layer = &Matrix3D_w_void_and_cluster_tracking::splat_interior_layer_dense<7, 0>;  break;
+            case  9: _splat_interior_layer = dense_layer_splat<9>();  break;
+            case 11: _splat_interior_layer = dense_layer_splat<11>(); break;
+            case 13: _splat_interior_layer = dense_layer_splat<13>(); break;
+            case 15: _splat_interior_layer = dense_layer_splat<15>(); break;
+            case 17: _splat_interior_layer = dense_layer_splat<17>(); break;
+            }
+        }
+    }
+
+};
+
+inline int dist2(int i0, int i1, int i2)
+{
+    return (i0 * i0 + i1 * i1 + i2 * i2);
+}
+
+inline Matrix3D GaussianMatrix(int size, float sigma)
+{
+    return GaussianMatrix(size, size, size, sigma, sigma, sigma);
+};
+
+// The exponent is summed exactly in double, so that equal sigmas give the same values as dist2() * inv_sigma2
+inline Matrix3D GaussianMatrix(int size0, int size1, int size2, float sigma0, float sigma1, float sigma2)
+{
+    assert(size0 % 2 == 1 && size1 % 2 == 1 && size2 % 2 == 1);
+
+    Matrix3D g(size0, size1, size2);
+
+    const int center0 = g.dim0() / 2;
+    const int center1 = g.dim1() / 2;
+    const int center2 = g.dim2() / 2;
+
+    const double inv_sigma2_0 = float(1 / (2 * sigma0 * sigma0));
+    const double inv_sigma2_1 = float(1 / (2 * sigma1 * sigma1));
+    const double inv_sigma2_2 = float(1 / (2 * sigma2 * sigma2));
+    for (int i2 = 0; i2 < g.dim2(); ++i2)
+    for (int i1 = 0; i1 < g.dim1(); ++i1)
+    for (int i0 = 0; i0 < g.dim0(); ++i0)
+    {
+        const float exponent = float(dist2(i0 - center0, 0, 0) * inv_sigma2_0 + dist2(0, i1 - center1, 0) * inv_sigma2_1 +
+                                     dist2(0, 0, i2 - center2) * inv_sigma2_2);
+        g.at({ i0, i1, i2 }) = exp(-exponent);
+    }
+
+    return g;
+};
+
+// count distinct random voxels, see set_random_pixels()
+template<class TrackedMatrix>
+void initial_bitmap(TrackedMatrix& mat3d, int count, unsigned int seed)
+{
+    mat3d.progress().start(Phase::initial_bitmap, 0, count);
+    mat3d.set_random_pixels(count, seed);
+    mat3d.progress().start(Phase::initial_bitmap, count, count);
+}
+
+// Swaps that many of the latest swaps are checked for a repeat by reorder_bitmap
+constexpr int REORDER_CYCLE_WINDOW = 64;
+
+// Moves the tightest cluster into the largest void until the void is no lower in energy than the cluster was,
+// i.e. until no swap lowers the total energy of the pattern, or after max_swaps swaps if max_swaps >= 0.
+// Every swap lowers the total energy in exact arithmetic, so the pattern cannot cycle, but rounding of the energies
+// can make it: a swap repeated within the last REORDER_CYCLE_WINDOW ones stops the reorder too. Returns the swaps done.
+template<class TrackedMatrix>
+int reorder_bitmap(TrackedMatrix& mat3d, int max_swaps = -1)
+{
+    mat3d.progress().start(Phase::reorder_bitmap, 0, 0);
+    auto index = [&](const T3& t) { return uint64_t(std::get<0>(t) + (std::get<1>(t) + int64_t(std::get<2>(t)) * mat3d.dim1()) * mat3d.dim0()); };
+    uint64_t recent[REORDER_CYCLE_WINDOW] = {};
+    int swaps = 0;
+    while (max_swaps < 0 || swaps < max_swaps)
+    {
+        const auto t_max = mat3d.max_cluster();
+        mat3d.reset_pixel(t_max);
+
+        const auto t_min = mat3d.max_void();
+        if (t_min == t_max || !(mat3d.energy(t_min) < mat3d.energy(t_max)))
+        {
+            mat3d.set_pixel(t_max, 0);
+            break;
+        }
+        mat3d.set_pixel(t_min, 0);
+        mat3d.progress().swapped();
+
+        // 0 is no swap, as t_min != t_max
+        const uint64_t swap = index(t_max) * mat3d.size() + index(t_min);
+        const bool repeated = std::find(std::begin(recent), std::end(recent), swap) != std::end(recent);
+        recent[swaps % REORDER_CYCLE_WINDOW] = swap;
+        ++swaps;
+        if (repeated)
+            break;
+    }
+    return swaps;
+}
+
+template<class TrackedMatrix>
+void rank_initial_bitmap(TrackedMatrix& mat3d, int count)
+{
+    mat3d.progress().start(Phase::rank_initial_bitmap, 0, count);
+    while (count > 0)
+    {
+        --count;
+        
+        const auto t_max = mat3d.max_cluster();
+        mat3d.reset_pixel(t_max);
+        mat3d.set_pixel(t_max, count);
+        mat3d.remove_tracking(t_max);
+        mat3d.progress().placed();
+    }
+}
+
+// Coarse to fine, instead of phase 1: ranks a prefix of mat3d from a coarse texture, whose size divides mat3d's, on a
+// matrix just reset(). Coarse voxels of the lowest prefix_fraction of ranks keep their ranks, each at the voxel of
+// lowest energy (the jitter) of the cell it covers in mat3d. The prefix is placed at once, its energies computed in
+// one pass by FFT convolution, so it costs no splats. Returns the number of voxels ranked, which phase_2_and_3
+// continues from.
+template<class TrackedMatrix>
+int64_t rank_upsampled_prefix(TrackedMatrix& mat3d, const RankMatrix3D& coarse, float prefix_fraction)
+{
+    const int f0 = mat3d.dim0() / coarse.dim0();
+    const int f1 = mat3d.dim1() / coarse.dim1();
+    const int f2 = mat3d.dim2() / coarse.dim2();
+
+    std::vector<int64_t> prefix;
+    for (int64_t idx = 0; idx < coarse.size(); ++idx)
+        if (coarse.get(idx) < prefix_fraction * coarse.size())
+            prefix.push_back(idx);
+    std::sort(prefix.begin(), prefix.end(), [&](int64_t a, int64_t b) { return coarse.get(a) < coarse.get(b); });
+
+    mat3d.cluster_tracking_off();
+    mat3d.progress().start(Phase::rank_upsampled_prefix, 0, prefix.size());
+    std::vector<T3> points;
+    points.reserve(prefix.size());
+    for (const int64_t idx : prefix)
+    {
+        const int c0 = static_cast<int>(idx % coarse.dim0());
+        const int c1 = static_cast<int>(idx / coarse.dim0() % coarse.dim1());
+        const int c2 = static_cast<int>(idx / (coarse.dim0() * coarse.dim1()));
+
+        // Cell in raster order, so ties resolve to the smallest index as in max_void()
+        T3 t_min(c0 * f0, c1 * f1, c2 * f2);
+        for (int g2 = 0; g2 < f2; ++g2)
+            for (int g1 = 0; g1 < f1; ++g1)
+                for (int g0 = 0; g0 < f0; ++g0)
+                {
+                    const T3 t(c0 * f0 + g0, c1 * f1 + g1, c2 * f2 + g2);
+                    if (mat3d.energy(t) < mat3d.energy(t_min))
+                        t_min = t;
+                }
+
+        points.push_back(t_min);
+    }
+    mat3d.set_pixels(points, true);
+    for (size_t rank = 0; rank < points.size(); ++rank)
+        mat3d.at(points[rank]) = static_cast<uint32_t>(rank);
+    mat3d.progress().start(Phase::rank_upsampled_prefix, points.size(), points.size());
+    return static_cast<int64_t>(points.size());
+}
+
+// Instead of phase 1, continues from the ranks of an earlier generation, e.g. to rank the rest with another filter:
+// voxels of ranks below count are placed with their ranks, on a matrix just reset(). count < 0 takes the longest prefix
+// of ranks 0, 1, 2, .. that appear once each, which is all the ranked voxels of a texture completed by rank_rest().
+// Returns the number of voxels placed, which phase_2_and_3 continues from.
+template<class TrackedMatrix>
+int64_t place_ranked_prefix(TrackedMatrix& mat3d, const RankMatrix3D& ranks, int64_t count = -1)
+{
+    if (ranks.dim0() != mat3d.dim0() || ranks.dim1() != mat3d.dim1() || ranks.dim2() != mat3d.dim2())
+        throw std::invalid_argument("ranks are not of the matrix's size");
+
+    std::vector<int> occurrences(ranks.size() + 1);
+    for (int64_t idx = 0; idx < ranks.size(); ++idx)
+        ++occurrences[std::min<int64_t>(ranks.get(idx), ranks.size())];
+    int64_t prefix = 0;
+    while (prefix < ranks.size() && occurrences[prefix] == 1)
+        ++prefix;
+    if (count > prefix)
+        throw std::invalid_argument("ranks 0 to " + std::to_string(count - 1) + " do not appear once each");
+    if (count < 0)
+        count = prefix;
+
+    std::vector<T3> points;
+    points.reserve(count);
+    for (int i2 = 0; i2 < ranks.dim2(); ++i2)
+        for (int i1 = 0; i1 < ranks.dim1(); ++i1)
+            for (int i0 = 0; i0 < ranks.dim0(); ++i0)
+                if (ranks.get({ i0, i1, i2 }) < count)
+                    points.emplace_back(i0, i1, i2);
+
+    mat3d.cluster_tracking_off();
+    mat3d.progress().start(Phase::place_ranked_prefix, 0, points.size());
+    mat3d.set_pixels(points);
+    for (const T3& t3 : points)
+        mat3d.at(t3) = ranks.get(t3);
+    mat3d.progress().start(Phase::place_ranked_prefix, points.size(), points.size());
+    return count;
+}
+
+// Ends a generation stopped at count, by phase_2_and_3(mat3d, .., count): all the voxels not ranked below count are
+// given the rank count, so that thresholds up to count select the voxels ranked, and place_ranked_prefix() finds them.
+template<class TrackedMatrix>
+void rank_rest(TrackedMatrix& mat3d, int64_t count)
+{
+    for (int i2 = 0; i2 < mat3d.dim2(); ++i2)
+        for (int i1 = 0; i1 < mat3d.dim1(); ++i1)
+            for (int i0 = 0; i0 < mat3d.dim0(); ++i0)
+                if (!mat3d.occupied({ i0, i1, i2 }) || mat3d.get({ i0, i1, i2 }) >= count)
+                    mat3d.at({ i0, i1, i2 }) = static_cast<uint32_t>(count);
+    mat3d.progress().start(Phase::done, count, mat3d.size());
+}
+
+template<class TrackedMatrix>
+void phase_1(TrackedMatrix& mat3d, int count, unsigned int seed, int max_reorder_swaps = -1)
+{
+    initial_bitmap(mat3d, count, seed);
+    reorder_bitmap(mat3d, max_reorder_swaps);
+    rank_initial_bitmap(mat3d, count);
+}
+
+// No need for separate phase 1 and phase 2
+// Minimum void 
+// Ranks count .. end - 1, or all the remaining voxels if end < 0. A later call can continue from end.
+template<class TrackedMatrix>
+void phase_2_and_3(TrackedMatrix& mat3d, int64_t count, int64_t end = -1)
+{
+    if (end < 0 || end > mat3d.size())
+        end = mat3d.size();
+
+    mat3d.cluster_tracking_off();
+    mat3d.progress().start(Phase::phase_2_and_3, count, mat3d.size());
+    for (; count < end; ++count)
+    {
+        const auto t_min = mat3d.max_void();
+        mat3d.set_pixel(t_min, static_cast<uint32_t>(count));
+        mat3d.progress().placed();
+    }
+    if (count == mat3d.size())
+        mat3d.progress().start(Phase::done, count, mat3d.size());
+}
+
+// Tiled phase 2 and 3, for large volumes: the volume is split along z into slabs (mat3d.can_tile(slabs)), and ranks
+// are placed in rounds, a round setting the largest void of each slab (set_largest_voids_of_slabs). Energies reach
+// across the slabs' faces, so slabs see each other's voxels from the next round on and the torus stays seamless.
+// Places the rounds from count that fit before end, and returns the count reached: phase_2_and_3 can place the rest.
+// Rounds only depend on the state, so a generation run in steps gives the same texture as one in a single call.
+template<class TrackedMatrix>
+int64_t phase_2_and_3_tiled(TrackedMatrix& mat3d, int slabs, int64_t count, int64_t end = -1)
+{
+    if (end < 0 || end > mat3d.size())
+        end = mat3d.size();
+
+    mat3d.cluster_tracking_off();
+    mat3d.progress().start(Phase::phase_2_and_3, count, mat3d.size());
+    while (end - count >= slabs)
+    {
+        const int placed = mat3d.set_largest_voids_of_slabs(slabs, count);
+        count += placed;
+        mat3d.progress().placed(placed);
+    }
+    if (count == mat3d.size())
+        mat3d.progress().start(Phase::done, count, mat3d.size());
+    return count;
+}
+
+// Ranks count .. start - 1 one by one, then batches of up to batch voids from start on (set_largest_voids_apart),
+// which threads splat concurrently. Batches stop before one could pass end, returns the count reached.
+template<class TrackedMatrix>
+int64_t phase_2_and_3_batched(TrackedMatrix& mat3d, int batch, int64_t start, int64_t count, int64_t end = -1)
+{
+    if (end < 0 || end > mat3d.size())
+        end = mat3d.size();
+
+    if (count < start)
+    {
+        phase_2_and_3(mat3d, count, std::min(start, end));
+        count = std::min(start, end);
+    }
+    mat3d.cluster_tracking_off();
+    mat3d.progress().start(Phase::phase_2_and_3, count, mat3d.size());
+    while (end - count >= batch)
+    {
+        const int placed = mat3d.set_largest_voids_apart(batch, count);
+        count += placed;
+        mat3d.progress().placed(placed);
+    }
+    if (count == mat3d.size())
+        mat3d.progress().start(Phase::done, count, mat3d.size());
+    return count;
+}
+
+// Generator for embedding, e.g. in a service that regenerates textures: owns the matrix (ranks, energies, trackers)
+// and the filter, built once. After the first generate() has sized the scratch buffers, generations allocate nothing,
+// except with SetTracker (tree nodes) or fft_initialization (transform buffers).
+template<template<class> class TrackerT = HeapTracker, class Energy = float>
+class VoidClusterGenerator
+{
+public:
+    using Matrix = Matrix3D_w_void_and_cluster_tracking<TrackerT, Energy>;
+
+    explicit VoidClusterGenerator(const Parameters& params) : _params(params), _matrix(params) {};
+    // Filter can be shared between generators
+    VoidClusterGenerator(const Parameters& params, std::shared_ptr<const GaussianKernel> filter) :
+        _params(params), _matrix(params, std::move(filter))
+    {};
+
+    // Back to the state before phase 1, with the jitter of seed, e.g. to run the phase functions on matrix()
+    void reset(unsigned int seed) { _matrix.reset(seed); };
+
+    // Whole texture of seed: phase 1, then phase 2 and 3, tiled if params.tiles > 1, batched if params.void_batch > 1
+    void generate(unsigned int seed)
+    {
+        _matrix.reset(seed);
+        phase_1(_matrix, _params.initial_count, seed, _params.max_reorder_swaps);
+        int64_t count = _params.initial_count;
+        if (_params.tiles > 1)
+            count = phase_2_and_3_tiled(_matrix, _params.tiles, count);
+        else if (_params.void_batch > 1)
+            count = phase_2_and_3_batched(_matrix, _params.void_batch, _params.void_batch_start(), count);
+        phase_2_and_3(_matrix, count);
+    }
+
+    // Ranks of the last texture, valid until the next reset() or generate()
+    const RankMatrix3D& ranks() const { return _matrix; };
+    int64_t size() const { return _matrix.size(); };
+
+    // Into a buffer of the caller, of size() values, x fastest, then y, then z
+    void copy_ranks(uint32_t* out, size_t out_size) const
+    {
+        check_size(out_size);
+        std::copy(_matrix.data(), _matrix.data() + size(), out);
+    }
+    // Rank values, rank / size, as saved in 32 bit volumes
+    void copy_rank_values(float* out, size_t out_size) const
+    {
+        check_size(out_size);
+        std::transform(_matrix.data(), _matrix.data() + size(), out, [&](uint32_t rank) { return rank_value(rank, size()); });
+    }
+
+    Matrix& matrix() { return _matrix; };
+    Progress& progress() const { return _matrix.progress(); };
+    const Statistics& statistics() const { return _matrix.statistics(); };
+
+private:
+    void check_size(size_t out_size) const
+    {
+        if (out_size != size_t(size()))
+            throw std::invalid_argument("buffer is not of the size of the texture");
+    }
+
+    const Parameters _params;
+    Matrix _matrix;
+};
+
+} // namespace vc3d